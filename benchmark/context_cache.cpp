@@ -0,0 +1,124 @@
+#include <iostream>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <memory>
+
+#include <audiorw.hpp>
+
+// Write a short stereo clip
+std::vector<std::vector<double>> clip(double duration, double sample_rate) {
+  size_t length = duration * sample_rate;
+  std::vector<std::vector<double>> audio(2, std::vector<double>(length));
+  for (size_t n = 0; n < length; n++) {
+    double t = n/sample_rate;
+    audio[0][n] = 0.5 * std::sin(2 * M_PI * 440 * t);
+    audio[1][n] = 0.5 * std::sin(2 * M_PI * 660 * t);
+  }
+  return audio;
+}
+
+// Time reading the clip over and over, optionally resampling it
+double benchmark_read(
+    const std::string & filename,
+    int iterations,
+    const audiorw::ReadOptions & options) {
+  double sample_rate;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; i++) {
+    audiorw::read(filename, sample_rate, 0, -1, options);
+  }
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double>(end - start).count()/iterations;
+}
+
+// Time encoding the clip over and over into memory
+double benchmark_write(
+    const std::vector<std::vector<double>> & audio,
+    const std::string & format,
+    int iterations,
+    const audiorw::WriteOptions & options) {
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; i++) {
+    std::vector<uint8_t> output;
+    audiorw::write(audio, output, format, 48000, options);
+  }
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double>(end - start).count()/iterations;
+}
+
+// Count the sample buffers allocated by the first and the last of
+// several reads, which only works when built with AUDIORW_STATS.
+// Once the pool is warm the reads shouldn't allocate any.
+void report_allocations(
+    const std::string & filename,
+    int iterations,
+    audiorw::ReadOptions options) {
+  audiorw::ReadStats stats;
+  options.stats_callback = [&](const audiorw::ReadStats & reader_stats) {
+    stats = reader_stats;
+  };
+  double sample_rate;
+  int64_t first = 0;
+  for (int i = 0; i < iterations; i++) {
+    audiorw::read(filename, sample_rate, 0, -1, options);
+    if (i == 0) first = stats.allocations;
+  }
+  if (!stats.enabled) return;
+  std::cout
+    << "  " << first << " buffers allocated by the first read, "
+    << stats.allocations << " by the last for "
+    << stats.frames << " frames"
+    << std::endl;
+}
+
+void report(const std::string & label, double cold, double warm) {
+  std::cout
+    << label << ": "
+    << cold * 1e3 << " ms cold, "
+    << warm * 1e3 << " ms warm ("
+    << cold/warm << "x)"
+    << std::endl;
+}
+
+int main(int argc, char ** argv) {
+  double duration = 1;
+  int iterations = 200;
+  if (argc > 1) duration = std::atof(argv[1]);
+  if (argc > 2) iterations = std::atoi(argv[2]);
+
+  std::cout << "Reading and writing " << duration << " second stereo clips at 48000 Hz" << std::endl;
+  std::vector<std::vector<double>> audio = clip(duration, 48000);
+
+  audiorw::ReadOptions cold_read;
+  audiorw::ReadOptions warm_read;
+  warm_read.cache = std::make_shared<audiorw::ContextCache>();
+  audiorw::WriteOptions cold_write;
+  audiorw::WriteOptions warm_write;
+  warm_write.cache = std::make_shared<audiorw::ContextCache>();
+
+  for (std::string extension : {"flac", "mp3", "ogg"}) {
+    std::string filename = "context_cache." + extension;
+    audiorw::write(audio, filename, 48000);
+
+    report("read " + extension,
+        benchmark_read(filename, iterations, cold_read),
+        benchmark_read(filename, iterations, warm_read));
+    report_allocations(filename, iterations, warm_read);
+  }
+
+  // Resampling adds a resampler to set up for every file
+  cold_read.sample_rate = 16000;
+  warm_read.sample_rate = 16000;
+  report("read flac at 16000 Hz",
+      benchmark_read("context_cache.flac", iterations, cold_read),
+      benchmark_read("context_cache.flac", iterations, warm_read));
+
+  for (std::string format : {"flac", "mp3"}) {
+    report("write " + format,
+        benchmark_write(audio, format, iterations, cold_write),
+        benchmark_write(audio, format, iterations, warm_write));
+  }
+
+  return 0;
+}
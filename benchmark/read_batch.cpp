@@ -0,0 +1,77 @@
+#include <iostream>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <thread>
+
+#include <audiorw.hpp>
+
+// Write short stereo clips to decode
+std::vector<std::string> generate(
+    const std::string & extension,
+    int clips,
+    double duration,
+    double sample_rate) {
+  size_t length = duration * sample_rate;
+  std::vector<std::vector<double>> audio(2, std::vector<double>(length));
+
+  std::vector<std::string> filenames;
+  for (int clip = 0; clip < clips; clip++) {
+    for (size_t n = 0; n < length; n++) {
+      double t = n/sample_rate;
+      audio[0][n] = 0.5 * std::sin(2 * M_PI * (220 + clip) * t);
+      audio[1][n] = 0.5 * std::sin(2 * M_PI * (330 + clip) * t);
+    }
+    std::string filename = "read_batch_" + std::to_string(clip) + "." + extension;
+    audiorw::write(audio, filename, sample_rate);
+    filenames.push_back(filename);
+  }
+  return filenames;
+}
+
+// Time a batch read with the given number of threads
+double benchmark(const std::vector<std::string> & filenames, int threads) {
+  audiorw::BatchOptions batch;
+  batch.threads = threads;
+
+  auto start = std::chrono::steady_clock::now();
+  std::vector<audiorw::ReadResult<float>> results =
+    audiorw::read_batch<float>(filenames, audiorw::ReadOptions(), batch);
+  auto end = std::chrono::steady_clock::now();
+
+  for (const audiorw::ReadResult<float> & result : results) {
+    if (!result.ok()) std::rethrow_exception(result.error);
+  }
+  return std::chrono::duration<double>(end - start).count();
+}
+
+int main(int argc, char ** argv) {
+  int clips = 256;
+  double duration = 2;
+  if (argc > 1) clips = std::atoi(argv[1]);
+  if (argc > 2) duration = std::atof(argv[2]);
+  int max_threads = std::max(int(std::thread::hardware_concurrency()), 1);
+
+  std::cout << "Decoding " << clips << " clips of " << duration << " seconds" << std::endl;
+  for (std::string extension : {"flac", "mp3"}) {
+    std::vector<std::string> filenames;
+    try {
+      filenames = generate(extension, clips, duration, 44100);
+    } catch (const std::exception & e) {
+      std::cout << extension << ": skipped, " << e.what() << std::endl;
+      continue;
+    }
+
+    double single = benchmark(filenames, 1);
+    for (int threads = 1; threads <= max_threads; threads *= 2) {
+      double seconds = threads == 1 ? single : benchmark(filenames, threads);
+      std::cout
+        << extension << ", " << threads << " threads: "
+        << clips/seconds << " files/s, "
+        << single/seconds << "x speedup"
+        << std::endl;
+    }
+  }
+
+  return 0;
+}
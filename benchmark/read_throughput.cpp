@@ -0,0 +1,74 @@
+#include <iostream>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+
+#include <audiorw.hpp>
+
+// Write a stereo file of the given length to decode
+void generate(const std::string & filename, double duration, double sample_rate) {
+  size_t length = duration * sample_rate;
+  std::vector<std::vector<double>> audio(2, std::vector<double>(length));
+  for (size_t n = 0; n < length; n++) {
+    double t = n/sample_rate;
+    audio[0][n] = 0.5 * std::sin(2 * M_PI * 440 * t);
+    audio[1][n] = 0.5 * std::sin(2 * M_PI * 660 * t);
+  }
+  audiorw::write(audio, filename, sample_rate);
+}
+
+// Time full reads of a file and report the decode throughput
+void benchmark(
+    const std::string & filename,
+    const std::string & label,
+    int iterations,
+    const audiorw::ReadOptions & options=audiorw::ReadOptions()) {
+  double sample_rate;
+  size_t frames = 0;
+
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; i++) {
+    std::vector<std::vector<double>> audio =
+      audiorw::read(filename, sample_rate, 0, -1, options);
+    frames += audio[0].size();
+  }
+  auto end = std::chrono::steady_clock::now();
+
+  double seconds = std::chrono::duration<double>(end - start).count();
+  std::cout
+    << label << ": "
+    << frames/seconds/1e6 << " Mframes/s, "
+    << seconds/iterations * 1e3 << " ms/read"
+    << std::endl;
+}
+
+int main(int argc, char ** argv) {
+  double duration = 600;
+  int iterations = 5;
+  if (argc > 1) duration = std::atof(argv[1]);
+  if (argc > 2) iterations = std::atoi(argv[2]);
+
+  std::cout << "Decoding " << duration << " seconds of stereo audio at 48000 Hz" << std::endl;
+  for (std::string extension : {"wav", "aif", "au", "flac"}) {
+    std::string filename = "read_throughput." + extension;
+    generate(filename, duration, 48000);
+    benchmark(filename, filename, iterations);
+  }
+
+  // Compare the native PCM reader against decoding through FFMPEG
+  audiorw::ReadOptions ffmpeg;
+  ffmpeg.native_pcm = false;
+  benchmark("read_throughput.wav", "read_throughput.wav (FFMPEG)", iterations, ffmpeg);
+
+  // Compare serial and pipelined decoding of compressed files
+  audiorw::ReadOptions pipelined;
+  pipelined.pipeline = true;
+  for (std::string extension : {"mp3", "ogg"}) {
+    std::string filename = "read_throughput." + extension;
+    generate(filename, duration, 48000);
+    benchmark(filename, filename, iterations);
+    benchmark(filename, filename + " (pipelined)", iterations, pipelined);
+  }
+
+  return 0;
+}
@@ -0,0 +1,177 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <functional>
+#include <cstdio>
+
+#include <sys/resource.h>
+
+#include <audiorw.hpp>
+
+// Synthesize a chord with a different note on each channel
+std::vector<std::vector<float>> generate(int channels, double duration, double sample_rate) {
+  size_t length = duration * sample_rate;
+  std::vector<std::vector<float>> audio(channels, std::vector<float>(length));
+  for (int channel = 0; channel < channels; channel++) {
+    double frequency = 220 * std::pow(2, channel/12.);
+    for (size_t n = 0; n < length; n++) {
+      audio[channel][n] = 0.5 * std::sin(2 * M_PI * frequency * n/sample_rate);
+    }
+  }
+  return audio;
+}
+
+// Reset the peak resident set size so the next measurement
+// only covers what follows. Only Linux supports this.
+void reset_peak_rss() {
+  std::ofstream clear_refs("/proc/self/clear_refs");
+  if (clear_refs) clear_refs << "5";
+}
+
+// The peak resident set size in kilobytes
+long peak_rss() {
+  std::ifstream status("/proc/self/status");
+  std::string line;
+  while (std::getline(status, line)) {
+    if (line.compare(0, 6, "VmHWM:") == 0) {
+      return std::atol(line.c_str() + 6);
+    }
+  }
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+std::string escape(const std::string & text) {
+  std::string escaped;
+  for (char c : text) {
+    if (c == '"' or c == '\\') {
+      escaped += '\\';
+      escaped += c;
+    } else if (c == '\n') {
+      escaped += "\\n";
+    } else {
+      escaped += c;
+    }
+  }
+  return escaped;
+}
+
+struct Case {
+  std::string operation;
+  std::string format;
+  int channels;
+  double duration;
+};
+
+// Run the operation until at least the minimum time has passed and
+// print a JSON record of its throughput. Each run handles the given
+// number of frames.
+void measure(
+    const Case & c,
+    size_t frames,
+    double min_time,
+    const std::function<void()> & operation,
+    std::ostream & output,
+    bool & first) {
+  std::ostringstream record;
+  record
+    << "{\"operation\": \"" << c.operation
+    << "\", \"format\": \"" << c.format
+    << "\", \"channels\": " << c.channels
+    << ", \"duration\": " << c.duration;
+
+  try {
+    reset_peak_rss();
+    int iterations = 0;
+    auto start = std::chrono::steady_clock::now();
+    double seconds = 0;
+    while (seconds < min_time or iterations < 1) {
+      operation();
+      iterations++;
+      seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    double frames_per_second = frames * iterations/seconds;
+    record
+      << ", \"iterations\": " << iterations
+      << ", \"seconds_per_iteration\": " << seconds/iterations
+      << ", \"frames_per_second\": " << frames_per_second
+      << ", \"samples_per_second\": " << frames_per_second * c.channels
+      << ", \"peak_rss_kb\": " << peak_rss();
+
+    std::cerr
+      << c.operation << " " << c.format << " "
+      << c.channels << "ch " << c.duration << "s: "
+      << frames_per_second * c.channels/1e6 << " Msamples/s"
+      << std::endl;
+  } catch (const std::exception & error) {
+    record << ", \"error\": \"" << escape(error.what()) << "\"";
+    std::cerr
+      << c.operation << " " << c.format << " "
+      << c.channels << "ch " << c.duration << "s: "
+      << error.what() << std::endl;
+  }
+  record << "}";
+
+  output << (first ? "[\n  " : ",\n  ") << record.str();
+  first = false;
+}
+
+int main(int argc, char ** argv) {
+  // The minimum time to spend on each case and where to put the results
+  double min_time = 1;
+  if (argc > 1) min_time = std::atof(argv[1]);
+  std::ofstream file;
+  if (argc > 2) file.open(argv[2]);
+  std::ostream & output = file.is_open() ? file : std::cout;
+
+  const double sample_rate = 48000;
+  bool first = true;
+  for (std::string format : {"wav", "aif", "au", "flac", "ogg", "mp3"}) {
+    for (int channels : {1, 2, 6}) {
+      for (double duration : {1., 60.}) {
+        std::string filename = "suite." + format;
+        size_t frames = duration * sample_rate;
+        std::vector<std::vector<float>> audio = generate(channels, duration, sample_rate);
+
+        measure({"write", format, channels, duration}, frames, min_time, [&]() {
+          audiorw::write(audio, filename, sample_rate);
+        }, output, first);
+
+        audiorw::WriteOptions dithered;
+        dithered.dither = true;
+        measure({"dithered_write", format, channels, duration}, frames, min_time, [&]() {
+          audiorw::write(audio, filename, sample_rate, dithered);
+        }, output, first);
+
+        measure({"read", format, channels, duration}, frames, min_time, [&]() {
+          double rate;
+          audiorw::read<float>(filename, rate);
+        }, output, first);
+
+        // A tenth of the file from the middle
+        measure({"ranged_read", format, channels, duration}, frames/10, min_time, [&]() {
+          double rate;
+          audiorw::read<float>(filename, rate, duration * 0.45, duration * 0.55);
+        }, output, first);
+
+        // Encode to memory and decode it again
+        measure({"round_trip", format, channels, duration}, frames, min_time, [&]() {
+          std::vector<uint8_t> encoded;
+          audiorw::write(audio, encoded, format == "aif" ? "aiff" : format, sample_rate);
+          double rate;
+          audiorw::read<float>(encoded.data(), encoded.size(), rate);
+        }, output, first);
+
+        std::remove(filename.c_str());
+      }
+    }
+  }
+  output << "\n]" << std::endl;
+
+  return 0;
+}
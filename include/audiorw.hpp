@@ -2,6 +2,15 @@
 
 #include <vector>
 #include <string>
+#include <memory>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+#include <exception>
+#include <functional>
+#include <map>
 
 extern "C" {
 #include <libavformat/avformat.h>
@@ -10,19 +19,945 @@ extern "C" {
 
 namespace audiorw {
 
+namespace internal {
+struct PcmFile;
+class PcmWriter;
+class CallbackIO;
+class ShardPrefetcher;
+class ContextPool;
+class Pipeline;
+class FramePool;
+struct Dither;
+}
+
 static const int OUTPUT_BIT_RATE = 320000;
 static const int DEFAULT_FRAME_SIZE = 2048;
+static const int SEEK_PREROLL_FRAME_SIZE = 4096;
+static const int READ_BLOCK_SIZE = 65536;
+static const size_t BUFFER_ALIGNMENT = 64;
+static const int64_t PARALLEL_SEGMENT_SIZE = 1 << 18;
+static const size_t PCM_WRITE_BUFFER_SIZE = 1 << 20;
+static const int IO_BUFFER_SIZE = 1 << 16;
+static const size_t SHARD_READ_SIZE = 1 << 22;
+static const size_t CONTEXT_CACHE_SIZE = 16;
+static const size_t PIPELINE_DEPTH = 16;
+static const int PEAK_BLOCK_SIZE = 256;
+static const int PEAK_LEVEL_FACTOR = 8;
+static const int64_t SEEK_TABLE_INTERVAL = 1 << 16;
+
+enum class Layout {
+  Planar,
+  Interleaved
+};
+
+// Audio samples in a single contiguous allocation. Sample (channel, frame)
+// lives at data()[channel * channel_stride() + frame * frame_stride()].
+template <typename T>
+class AudioBuffer {
+  public:
+    AudioBuffer() :
+      channels_(0),
+      frames_(0),
+      channel_stride_(0),
+      frame_stride_(0),
+      data_(NULL) {}
+
+    // Allocate silence aligned to BUFFER_ALIGNMENT bytes. Planar
+    // channels are padded so each of them starts aligned too.
+    AudioBuffer(int channels, size_t frames, Layout layout=Layout::Planar) :
+      AudioBuffer() {
+      allocate(channels, frames, layout);
+    }
+
+    // View existing samples without taking ownership of them
+    AudioBuffer(
+        T * data,
+        int channels,
+        size_t frames,
+        ptrdiff_t channel_stride,
+        ptrdiff_t frame_stride) :
+      channels_(channels),
+      frames_(frames),
+      channel_stride_(channel_stride),
+      frame_stride_(frame_stride),
+      data_(data) {}
+
+    AudioBuffer(const AudioBuffer &) = delete;
+    AudioBuffer & operator=(const AudioBuffer &) = delete;
+
+    AudioBuffer(AudioBuffer && other) : AudioBuffer() {
+      swap(other);
+    }
+    AudioBuffer & operator=(AudioBuffer && other) {
+      swap(other);
+      return *this;
+    }
+
+    T * data() { return data_; }
+    const T * data() const { return data_; }
+    T * channel(int channel) { return data_ + channel * channel_stride_; }
+    const T * channel(int channel) const { return data_ + channel * channel_stride_; }
+    T & operator()(int channel, size_t frame) {
+      return data_[channel * channel_stride_ + frame * frame_stride_];
+    }
+    const T & operator()(int channel, size_t frame) const {
+      return data_[channel * channel_stride_ + frame * frame_stride_];
+    }
+
+    int channels() const { return channels_; }
+    size_t frames() const { return frames_; }
+    ptrdiff_t channel_stride() const { return channel_stride_; }
+    ptrdiff_t frame_stride() const { return frame_stride_; }
+    bool owns_data() const { return bool(storage_); }
+    bool planar() const { return frame_stride_ == 1; }
+    bool interleaved() const {
+      return channel_stride_ == 1 and frame_stride_ == channels_;
+    }
+
+    // Change the number of frames of an owned buffer, keeping its
+    // layout and the samples that still fit. Shrinking does not reallocate.
+    void resize(size_t frames) {
+      if (!owns_data()) {
+        throw std::logic_error("Can not resize a buffer that does not own its samples");
+      }
+      if (frames <= frames_) {
+        frames_ = frames;
+        return;
+      }
+      AudioBuffer resized(channels_, frames, planar() ? Layout::Planar : Layout::Interleaved);
+      size_t kept = std::min(frames, frames_);
+      for (int c = 0; c < channels_; c++) {
+        for (size_t f = 0; f < kept; f++) {
+          resized(c, f) = (*this)(c, f);
+        }
+      }
+      swap(resized);
+    }
+
+    void swap(AudioBuffer & other) {
+      std::swap(channels_, other.channels_);
+      std::swap(frames_, other.frames_);
+      std::swap(channel_stride_, other.channel_stride_);
+      std::swap(frame_stride_, other.frame_stride_);
+      std::swap(data_, other.data_);
+      std::swap(storage_, other.storage_);
+    }
+
+  private:
+    void allocate(int channels, size_t frames, Layout layout) {
+      channels_ = channels;
+      frames_ = frames;
+      size_t samples;
+      if (layout == Layout::Planar) {
+        size_t alignment = BUFFER_ALIGNMENT/sizeof(T);
+        channel_stride_ = (frames + alignment - 1)/alignment * alignment;
+        frame_stride_ = 1;
+        samples = channels * channel_stride_;
+      } else {
+        channel_stride_ = 1;
+        frame_stride_ = channels;
+        samples = channels * frames;
+      }
+      storage_.reset(new uint8_t[samples * sizeof(T) + BUFFER_ALIGNMENT]());
+      uintptr_t address = reinterpret_cast<uintptr_t>(storage_.get());
+      address = (address + BUFFER_ALIGNMENT - 1) & ~uintptr_t(BUFFER_ALIGNMENT - 1);
+      data_ = reinterpret_cast<T *>(address);
+    }
+
+    int channels_;
+    size_t frames_;
+    ptrdiff_t channel_stride_;
+    ptrdiff_t frame_stride_;
+    T * data_;
+    std::unique_ptr<uint8_t[]> storage_;
+};
+
+// A read only view of audio samples indexed like AudioBuffer. The view
+// keeps whatever holds the samples alive, be it a memory mapping or a
+// decoded buffer, and copies of it share that.
+template <typename T>
+class AudioView {
+  public:
+    AudioView() :
+      channels_(0),
+      frames_(0),
+      channel_stride_(0),
+      frame_stride_(0),
+      data_(NULL),
+      mapped_(false) {}
+
+    // View samples that are kept alive by the owner
+    AudioView(
+        const T * data,
+        int channels,
+        size_t frames,
+        ptrdiff_t channel_stride,
+        ptrdiff_t frame_stride,
+        std::shared_ptr<const void> owner,
+        bool mapped=false) :
+      channels_(channels),
+      frames_(frames),
+      channel_stride_(channel_stride),
+      frame_stride_(frame_stride),
+      data_(data),
+      mapped_(mapped),
+      owner_(owner) {}
 
-std::vector<std::vector<double>> read(
+    // Take over a buffer
+    explicit AudioView(AudioBuffer<T> && audio) : AudioView() {
+      std::shared_ptr<AudioBuffer<T>> buffer(new AudioBuffer<T>(std::move(audio)));
+      channels_ = buffer -> channels();
+      frames_ = buffer -> frames();
+      channel_stride_ = buffer -> channel_stride();
+      frame_stride_ = buffer -> frame_stride();
+      data_ = buffer -> data();
+      owner_ = buffer;
+    }
+
+    const T * data() const { return data_; }
+    const T * channel(int channel) const { return data_ + channel * channel_stride_; }
+    const T & operator()(int channel, size_t frame) const {
+      return data_[channel * channel_stride_ + frame * frame_stride_];
+    }
+
+    int channels() const { return channels_; }
+    size_t frames() const { return frames_; }
+    ptrdiff_t channel_stride() const { return channel_stride_; }
+    ptrdiff_t frame_stride() const { return frame_stride_; }
+    bool planar() const { return frame_stride_ == 1; }
+    bool interleaved() const {
+      return channel_stride_ == 1 and frame_stride_ == channels_;
+    }
+    // Whether the samples are read straight from the file's memory mapping
+    bool mapped() const { return mapped_; }
+
+  private:
+    int channels_;
+    size_t frames_;
+    ptrdiff_t channel_stride_;
+    ptrdiff_t frame_stride_;
+    const T * data_;
+    bool mapped_;
+    std::shared_ptr<const void> owner_;
+};
+
+enum class ResampleQuality {
+  Fast,
+  Default,
+  High
+};
+
+// Keeps decoders, encoders and resamplers open between files so that
+// reading or writing many short files with the same parameters doesn't
+// set them up from scratch each time. Share one through ReadOptions or
+// WriteOptions, it can be used from many threads at once.
+class ContextCache {
+  public:
+    // Keep up to this many of each kind of context
+    explicit ContextCache(size_t capacity=CONTEXT_CACHE_SIZE);
+    ~ContextCache();
+
+    ContextCache(const ContextCache &) = delete;
+    ContextCache & operator=(const ContextCache &) = delete;
+
+    // Free everything that is cached
+    void clear();
+
+  private:
+    friend class Reader;
+    friend class Writer;
+    std::unique_ptr<internal::ContextPool> pool_;
+};
+
+class PeakIndex;
+
+// Where a reader spent its time, for finding slow codecs and storage.
+// Only collected when the library is built with AUDIORW_STATS,
+// otherwise everything is zero.
+struct ReadStats {
+  bool enabled = false;
+  // Cumulative nanoseconds opening the file, reading packets
+  // (av_read_frame), decoding them, converting samples with
+  // swr or the native PCM reader, and copying them as they are
+  int64_t open_time = 0;
+  int64_t demux_time = 0;
+  int64_t decode_time = 0;
+  int64_t convert_time = 0;
+  int64_t copy_time = 0;
+  // Packets read and their bytes, frames decoded and frames output
+  int64_t packets = 0;
+  int64_t bytes = 0;
+  int64_t frames = 0;
+  int64_t samples = 0;
+  // Sample buffers newly allocated for decoded frames, rather
+  // than reused from the pool, which stops once it is warm
+  int64_t allocations = 0;
+};
+
+struct ReadOptions {
+  // Resample to this rate, or keep the rate of the file if zero
+  int sample_rate = 0;
+  // Mix to this channel layout (AV_CH_LAYOUT_*) or, if it
+  // is zero, to the default layout of this many channels.
+  // If both are zero keep the channels of the file.
+  uint64_t channel_layout = 0;
+  int channels = 0;
+  ResampleQuality quality = ResampleQuality::Default;
+  // Split long PCM, FLAC and Ogg files into this many segments
+  // that are decoded in parallel by read and read_buffer, or
+  // one per hardware thread if zero
+  int threads = 1;
+  // Read uncompressed WAV, AIFF and AU files straight from a
+  // memory mapping rather than through FFMPEG when they
+  // don't need resampling or remixing
+  bool native_pcm = true;
+  // The buffer between FFMPEG and memory or callback input
+  int io_buffer_size = IO_BUFFER_SIZE;
+  // Read packets and decode them on two background threads while
+  // the calling thread converts, with up to PIPELINE_DEPTH packets
+  // and frames in flight. Read callbacks are then called from the
+  // background thread.
+  bool pipeline = false;
+  // Reuse decoders and resamplers from here if set
+  std::shared_ptr<ContextCache> cache;
+  // Seek MP3 files to exact packets with the seek table of this index
+  // of the same file, rather than with FFMPEG's estimates, which are
+  // approximate for variable bit rates. Only used when reading from a
+  // file whose size and modification time match the index's.
+  std::shared_ptr<const PeakIndex> index;
+  // Called with each reader's stats when it is closed, which for
+  // parallel reads is once per segment on the worker threads
+  std::function<void(const ReadStats &)> stats_callback;
+};
+
+struct WriteOptions {
+  // The encoder by name (e.g. "libvorbis" or "pcm_s24le"),
+  // or empty to use the container's default
+  std::string codec;
+  // The target bit rate of lossy encoders
+  int64_t bit_rate = OUTPUT_BIT_RATE;
+  // Variable bit rate quality on the encoder's own scale, e.g.
+  // 0 to 10 for Vorbis. Used instead of the bit rate if set.
+  double quality = -1;
+  // Trades speed against size, e.g. 0 to 12 for FLAC, or the
+  // encoder's default if negative
+  int compression_level = -1;
+  // The sample format to encode, or the encoder's preferred one
+  // if none. Uncompressed files store exactly this format.
+  AVSampleFormat sample_format = AV_SAMPLE_FMT_NONE;
+  // Bits per sample for formats that can store fewer than the sample
+  // format holds, e.g. 24 bit FLAC or WAV from AV_SAMPLE_FMT_S32
+  int bits_per_sample = 0;
+  // Add triangular dither when float or double samples are rounded
+  // to integers, rather than truncation distortion on quiet passages.
+  // The noise is one least significant bit of the depth that is
+  // stored, e.g. 24 bits of AV_SAMPLE_FMT_S32. Floating point outputs
+  // are not rounded, and 8 or 64 bit integer encoders are an error.
+  bool dither = false;
+  // Samples per frame for encoders that take any size,
+  // or their own default if zero
+  int frame_size = 0;
+  // Passed straight to the encoder and the muxer as
+  // AVDictionary options, unknown names are an error
+  std::map<std::string, std::string> codec_options;
+  std::map<std::string, std::string> format_options;
+  // Threads for encoders that support them, or one per hardware
+  // thread if zero. Most audio encoders are single threaded.
+  int threads = 1;
+  // FF_THREAD_FRAME and/or FF_THREAD_SLICE
+  int thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+  // The buffer between FFMPEG and memory or callback output
+  int io_buffer_size = IO_BUFFER_SIZE;
+  // Reuse encoders and resamplers from here if set
+  std::shared_ptr<ContextCache> cache;
+};
+
+// Callbacks to read encoded audio from anywhere, e.g. a network stream
+struct ReadCallbacks {
+  // Read up to size bytes into data and return how
+  // many were read, which is zero at the end
+  std::function<size_t(uint8_t * data, size_t size)> read;
+  // Optional, move to a byte offset from the start
+  // of the stream and return whether that worked
+  std::function<bool(int64_t offset)> seek;
+  // Optional, the size of the stream in bytes or -1 if it is unknown
+  std::function<int64_t()> size;
+};
+
+// Callbacks to write encoded audio anywhere
+struct WriteCallbacks {
+  // Write all of the bytes or throw
+  std::function<void(const uint8_t * data, size_t size)> write;
+  // Optional, move to a byte offset from the start of the stream and
+  // return whether that worked. Some formats, like WAV, seek back to
+  // finish their headers.
+  std::function<bool(int64_t offset)> seek;
+};
+
+// The sample type can be double or float in the range [-1,1]
+// or int16_t or int32_t over their full range
+template <typename T = double>
+std::vector<std::vector<T>> read(
     const std::string & filename,
     double & sample_rate,
     double start_seconds=0,
-    double end_seconds=-1);
+    double end_seconds=-1,
+    const ReadOptions & options=ReadOptions());
+
+// Read encoded audio from memory, which is not copied
+template <typename T = double>
+std::vector<std::vector<T>> read(
+    const uint8_t * data,
+    size_t size,
+    double & sample_rate,
+    double start_seconds=0,
+    double end_seconds=-1,
+    const ReadOptions & options=ReadOptions());
+
+// Read encoded audio through callbacks
+template <typename T = double>
+std::vector<std::vector<T>> read(
+    const ReadCallbacks & callbacks,
+    double & sample_rate,
+    double start_seconds=0,
+    double end_seconds=-1,
+    const ReadOptions & options=ReadOptions());
+
+template <typename T>
+void write(
+    const std::vector<std::vector<T>> & audio,
+    const std::string & filename,
+    double sample_rate,
+    const WriteOptions & options=WriteOptions());
+
+// Encode audio in the named container format (e.g. "wav",
+// "flac", "mp3") and append it to the output
+template <typename T>
+void write(
+    const std::vector<std::vector<T>> & audio,
+    std::vector<uint8_t> & output,
+    const std::string & format,
+    double sample_rate,
+    const WriteOptions & options=WriteOptions());
+
+// Encode audio in the named container format through callbacks
+template <typename T>
+void write(
+    const std::vector<std::vector<T>> & audio,
+    const WriteCallbacks & callbacks,
+    const std::string & format,
+    double sample_rate,
+    const WriteOptions & options=WriteOptions());
+
+// Read into a single contiguous buffer of the given layout
+template <typename T = double>
+AudioBuffer<T> read_buffer(
+    const std::string & filename,
+    double & sample_rate,
+    double start_seconds=0,
+    double end_seconds=-1,
+    Layout layout=Layout::Planar,
+    const ReadOptions & options=ReadOptions());
+
+template <typename T = double>
+AudioBuffer<T> read_buffer(
+    const uint8_t * data,
+    size_t size,
+    double & sample_rate,
+    double start_seconds=0,
+    double end_seconds=-1,
+    Layout layout=Layout::Planar,
+    const ReadOptions & options=ReadOptions());
+
+template <typename T = double>
+AudioBuffer<T> read_buffer(
+    const ReadCallbacks & callbacks,
+    double & sample_rate,
+    double start_seconds=0,
+    double end_seconds=-1,
+    Layout layout=Layout::Planar,
+    const ReadOptions & options=ReadOptions());
+
+// View the samples of an uncompressed file in place when they are
+// stored as T and need no conversion, e.g. 16 bit WAV as int16_t or
+// float WAV as float. Pages are only read as they are touched and are
+// shared with other processes mapping the file. Anything else is
+// decoded into memory as read_buffer would.
+template <typename T = double>
+AudioView<T> read_view(
+    const std::string & filename,
+    double & sample_rate,
+    double start_seconds=0,
+    double end_seconds=-1,
+    const ReadOptions & options=ReadOptions());
+
+template <typename T>
+void write(
+    const AudioBuffer<T> & audio,
+    const std::string & filename,
+    double sample_rate,
+    const WriteOptions & options=WriteOptions());
 
+template <typename T>
 void write(
-    const std::vector<std::vector<double>> & audio,
+    const AudioBuffer<T> & audio,
+    std::vector<uint8_t> & output,
+    const std::string & format,
+    double sample_rate,
+    const WriteOptions & options=WriteOptions());
+
+template <typename T>
+void write(
+    const AudioBuffer<T> & audio,
+    const WriteCallbacks & callbacks,
+    const std::string & format,
+    double sample_rate,
+    const WriteOptions & options=WriteOptions());
+
+struct InfoOptions {
+  // Run avformat_find_stream_info, briefly, to fill in anything the
+  // header leaves out. Skipping it is much faster and safe for
+  // containers that describe their streams up front like WAV, FLAC
+  // or MP4. It is run anyway if the rate or channels are missing.
+  bool probe = true;
+  // The most audio the probe may decode, in seconds
+  double probe_seconds = 0.5;
+  // Parse uncompressed WAV, AIFF and AU headers without FFMPEG
+  bool native_pcm = true;
+};
+
+struct AudioInfo {
+  double sample_rate = 0;
+  int channels = 0;
+  uint64_t channel_layout = 0;
+  AVCodecID codec_id = AV_CODEC_ID_NONE;
+  // e.g. "flac" and "ogg"
+  std::string codec_name;
+  std::string format_name;
+  // The format the decoder produces
+  AVSampleFormat sample_format = AV_SAMPLE_FMT_NONE;
+  // Bits per stored sample, or zero if the codec doesn't have them
+  int bits_per_sample = 0;
+  // In samples at the file's rate, or -1 if unknown
+  int64_t duration = -1;
+  // Bits per second, or zero if unknown
+  int64_t bit_rate = 0;
+};
+
+// Describe the audio stream of a file from its headers without
+// decoding it, e.g. to build a manifest of many files
+AudioInfo info(
     const std::string & filename,
-    double sample_rate);
+    const InfoOptions & options=InfoOptions());
+
+struct BatchOptions {
+  // The number of files to decode at once, or one
+  // per hardware thread if zero
+  int threads = 0;
+};
+
+template <typename T>
+struct ReadResult {
+  std::string filename;
+  std::vector<std::vector<T>> audio;
+  double sample_rate = 0;
+  // Set if the file could not be read, rethrow it for the details
+  std::exception_ptr error;
+
+  bool ok() const { return !error; }
+};
+
+// Read many files concurrently. A file that fails to
+// read does not stop the others, its error is returned.
+template <typename T = double>
+std::vector<ReadResult<T>> read_batch(
+    const std::vector<std::string> & filenames,
+    const ReadOptions & options=ReadOptions(),
+    const BatchOptions & batch=BatchOptions());
+
+template <typename T>
+struct ReadCallback {
+  typedef std::function<void(size_t, ReadResult<T> &)> type;
+};
+
+// Read many files concurrently, handing each result to the callback as
+// soon as it is decoded along with the file's index. The callback is run
+// on the worker threads but never on more than one at once.
+template <typename T = double>
+void read_batch(
+    const std::vector<std::string> & filenames,
+    const typename ReadCallback<T>::type & callback,
+    const ReadOptions & options=ReadOptions(),
+    const BatchOptions & batch=BatchOptions());
+
+struct WriteResult {
+  std::string filename;
+  // Set if the file could not be written, rethrow it for the details
+  std::exception_ptr error;
+
+  bool ok() const { return !error; }
+};
+
+template <typename T>
+struct WriteSource {
+  typedef std::function<void(size_t, std::vector<std::vector<T>> &, double &)> type;
+};
+
+// Write many files concurrently. A file that fails to
+// write does not stop the others, its error is returned.
+template <typename T>
+std::vector<WriteResult> write_batch(
+    const std::vector<std::vector<std::vector<T>>> & audio,
+    const std::vector<std::string> & filenames,
+    double sample_rate,
+    const WriteOptions & options=WriteOptions(),
+    const BatchOptions & batch=BatchOptions());
+
+// Write many files concurrently, asking the source for each file's
+// audio and sample rate, by its index, just before it is encoded. Only
+// as many files as there are threads are held in memory at once. The
+// source is run on the worker threads and may be run on several at once.
+template <typename T>
+std::vector<WriteResult> write_batch(
+    const std::vector<std::string> & filenames,
+    const typename WriteSource<T>::type & source,
+    const WriteOptions & options=WriteOptions(),
+    const BatchOptions & batch=BatchOptions());
+
+struct ShardOptions {
+  // Bytes read from the shard at a time
+  size_t read_size = SHARD_READ_SIZE;
+  // The number of reads the background thread may run ahead by
+  int read_ahead = 4;
+  // Only decode members with these extensions (e.g. "flac"),
+  // or every member if empty
+  std::vector<std::string> extensions;
+  // How each member is decoded
+  ReadOptions read;
+};
+
+// Streams through a tar archive, or several concatenated ones, decoding
+// each member from memory as it goes. The shard is read sequentially in
+// large blocks by a background thread so decoding never waits on disk.
+class ShardReader {
+  public:
+    ShardReader(
+        const std::string & filename,
+        const ShardOptions & options=ShardOptions());
+    ~ShardReader();
+
+    ShardReader(const ShardReader &) = delete;
+    ShardReader & operator=(const ShardReader &) = delete;
+
+    // Decode the next member into the result, whose filename is the
+    // member's name. Returns false once the shard is finished. A member
+    // that fails to decode sets the error rather than throwing, but a
+    // broken archive throws.
+    template <typename T>
+    bool next(ReadResult<T> & result);
+
+  private:
+    const uint8_t * take(size_t size);
+    void skip(size_t size);
+    bool next_chunk();
+    bool wanted(const std::string & name) const;
+
+    std::string filename_;
+    ShardOptions options_;
+    std::unique_ptr<internal::ShardPrefetcher> prefetcher_;
+    // The block being parsed and how far into it we are
+    std::vector<uint8_t> chunk_;
+    size_t offset_;
+    // Holds anything that straddles blocks
+    std::vector<uint8_t> scratch_;
+    // Padding after the last member's data
+    size_t padding_;
+};
+
+class Reader {
+  public:
+    // Open an audio file for streaming. Positions, rates and
+    // channel counts are those of the output after conversion.
+    Reader(
+        const std::string & filename,
+        const ReadOptions & options=ReadOptions());
+    // Decode audio held in memory, which must outlive the reader
+    Reader(
+        const uint8_t * data,
+        size_t size,
+        const ReadOptions & options=ReadOptions());
+    // Decode audio read through callbacks
+    Reader(
+        const ReadCallbacks & callbacks,
+        const ReadOptions & options=ReadOptions());
+    ~Reader();
+
+    Reader(const Reader &) = delete;
+    Reader & operator=(const Reader &) = delete;
+
+    // Read up to the given number of frames of interleaved
+    // audio. Fewer frames are only returned at the end of the file.
+    size_t read_block(int16_t * audio, size_t frames);
+    size_t read_block(int32_t * audio, size_t frames);
+    size_t read_block(float * audio, size_t frames);
+    size_t read_block(double * audio, size_t frames);
+
+    // Read up to the given number of frames
+    // of audio with one pointer per channel
+    size_t read_block(int16_t * const * audio, size_t frames);
+    size_t read_block(int32_t * const * audio, size_t frames);
+    size_t read_block(float * const * audio, size_t frames);
+    size_t read_block(double * const * audio, size_t frames);
+
+    // Fill a planar or interleaved buffer from the given frame
+    // onwards, returning the number of frames read
+    template <typename T>
+    size_t read_block(AudioBuffer<T> & audio, size_t offset=0);
+
+    // Move to a frame, sample accurately
+    void seek(int64_t frame);
+
+    // The frame the next read will start at
+    int64_t tell() const;
+
+    double sample_rate() const;
+    int channels() const;
+
+    // The length of the file in frames or -1 if it is unknown
+    int64_t duration() const;
+
+    // The codec of the audio stream and the name of its container
+    AVCodecID codec_id() const;
+    std::string format_name() const;
+
+    // Timings and counts so far, if the library collects them.
+    // With pipelining, the background stages' share is added
+    // when they stop, at the end of the file or on a seek.
+    const ReadStats & stats() const;
+
+  private:
+    explicit Reader(const ReadOptions & options);
+    static int get_buffer(AVCodecContext * codec_context, AVFrame * frame, int flags);
+    void open();
+    bool open_pcm();
+    void release();
+    size_t read_samples(uint8_t * const * audio, size_t frames, AVSampleFormat format);
+    bool decode_frame();
+    void configure_output(AVSampleFormat format);
+
+    friend class PeakIndex;
+
+    std::string filename_;
+    ReadOptions options_;
+    // Memory to read from instead of the file
+    const uint8_t * data_;
+    size_t size_;
+    std::unique_ptr<internal::CallbackIO> io_;
+    AVFormatContext * format_context_;
+    AVCodecContext * codec_context_;
+    SwrContext * resample_context_;
+    AVFrame * frame_;
+    AVPacket * packet_;
+    AVStream * stream_;
+    // Where the decoder's frames get their samples
+    std::shared_ptr<internal::FramePool> frame_pool_;
+    // Demuxes and decodes in the background if set
+    std::unique_ptr<internal::Pipeline> pipeline_;
+    // The index to seek with if it matches the file, and
+    // the index being built while reading, if any
+    const PeakIndex * seek_index_;
+    PeakIndex * index_builder_;
+    // Set instead of the FFMPEG contexts when reading PCM natively
+    std::unique_ptr<internal::PcmFile> pcm_;
+    AVSampleFormat output_format_;
+    int output_sample_rate_;
+    uint64_t output_channel_layout_;
+    int output_channels_;
+    // Scratch for offsetting sample pointers, reused between blocks
+    std::vector<uint8_t *> input_planes_;
+    std::vector<uint8_t *> output_planes_;
+    std::vector<uint8_t *> buffer_planes_;
+
+    // The frame the next read will start at
+    int64_t position_;
+    // The input frame the next decoded frame starts at or -1 after a seek
+    int64_t next_frame_position_;
+    // The input frame to start decoding at after a seek or -1
+    int64_t seek_target_;
+    // The number of samples of the decoded frame already read
+    int frame_offset_;
+    bool draining_;
+    bool flushed_;
+    ReadStats stats_;
+};
+
+class Writer {
+  public:
+    // Open an audio file for encoding, the encoder
+    // is chosen from the file extension
+    Writer(
+        const std::string & filename,
+        double sample_rate,
+        int channels,
+        const WriteOptions & options=WriteOptions());
+    // Encode audio in the named container format and append it to the
+    // output, which must outlive the writer
+    Writer(
+        std::vector<uint8_t> & output,
+        const std::string & format,
+        double sample_rate,
+        int channels,
+        const WriteOptions & options=WriteOptions());
+    // Encode audio in the named container format through callbacks
+    Writer(
+        const WriteCallbacks & callbacks,
+        const std::string & format,
+        double sample_rate,
+        int channels,
+        const WriteOptions & options=WriteOptions());
+    ~Writer();
+
+    Writer(const Writer &) = delete;
+    Writer & operator=(const Writer &) = delete;
+
+    // Encode frames of interleaved audio
+    void write_block(const int16_t * audio, size_t frames);
+    void write_block(const int32_t * audio, size_t frames);
+    void write_block(const float * audio, size_t frames);
+    void write_block(const double * audio, size_t frames);
+
+    // Encode frames of audio with one pointer per channel
+    void write_block(const int16_t * const * audio, size_t frames);
+    void write_block(const int32_t * const * audio, size_t frames);
+    void write_block(const float * const * audio, size_t frames);
+    void write_block(const double * const * audio, size_t frames);
+
+    // Encode all frames of a planar or interleaved buffer
+    template <typename T>
+    void write_block(const AudioBuffer<T> & audio);
+
+    // Drain the encoder and finish the file. If this is not
+    // called the destructor does it, but errors are lost.
+    void close();
+
+  private:
+    Writer(int channels, const WriteOptions & options);
+    void open(double sample_rate);
+    void release();
+    void write_samples(const uint8_t * const * audio, size_t frames, AVSampleFormat format);
+    void encode_frame(AVFrame * frame);
+    void allocate_frame();
+    void configure_input(AVSampleFormat format);
+
+    std::string filename_;
+    // The container format if it isn't guessed from the filename
+    std::string format_;
+    int channels_;
+    WriteOptions options_;
+    bool open_;
+    std::unique_ptr<internal::CallbackIO> io_;
+    AVFormatContext * format_context_;
+    AVCodecContext * codec_context_;
+    SwrContext * resample_context_;
+    // Set instead of the FFMPEG contexts when writing PCM natively
+    std::unique_ptr<internal::PcmWriter> pcm_;
+    // Buffers samples until there is a full frame to encode
+    AVFrame * frame_;
+    // Where the frame gets its samples
+    std::shared_ptr<internal::FramePool> frame_pool_;
+    // Set if float samples are dithered on the way to integers
+    std::unique_ptr<internal::Dither> dither_;
+    AVPacket * packet_;
+    AVSampleFormat input_format_;
+    // Scratch for offsetting sample pointers, reused between blocks
+    std::vector<uint8_t *> input_planes_;
+    std::vector<uint8_t *> output_planes_;
+    std::vector<const uint8_t *> buffer_planes_;
+    int64_t pts_;
+};
+
+// The smallest, largest and RMS sample of a span of one channel
+struct Peak {
+  float min = 0;
+  float max = 0;
+  float rms = 0;
+};
+
+struct PeakOptions {
+  // Frames summarized by each peak of the finest level
+  int block_size = PEAK_BLOCK_SIZE;
+  // Each coarser level summarizes this many peaks of the one below
+  int level_factor = PEAK_LEVEL_FACTOR;
+  // Frames between entries of the seek table
+  int64_t seek_interval = SEEK_TABLE_INTERVAL;
+};
+
+// A waveform overview of a file at several resolutions, built in one
+// decoding pass, to draw long files without decoding them again. It
+// also records where packets start, for seeking MP3 files exactly.
+class PeakIndex {
+  public:
+    PeakIndex();
+    // Decode the file once to build its index
+    explicit PeakIndex(
+        const std::string & filename,
+        const PeakOptions & options=PeakOptions());
+
+    // Read and write the index as a compact sidecar file
+    static PeakIndex load(const std::string & filename);
+    void save(const std::string & filename) const;
+
+    // Load the index from the file's sidecar, the filename followed by
+    // ".peaks", or build it if the sidecar is missing or older than
+    // the file and then try to save it
+    static PeakIndex cached(
+        const std::string & filename,
+        const PeakOptions & options=PeakOptions());
+
+    double sample_rate() const;
+    int channels() const;
+    int64_t frames() const;
+
+    // Summarize the frames from start to end as the given number of
+    // points for each channel, from the coarsest level with enough
+    // detail. Points never get finer than the block size.
+    std::vector<std::vector<Peak>> peaks(
+        int64_t start_frame,
+        int64_t end_frame,
+        size_t points) const;
+
+  private:
+    friend class Reader;
+
+    // A packet at a byte position whose audio starts at a frame
+    struct SeekPoint {
+      int64_t byte_position;
+      int64_t frame;
+    };
+
+    // Whether the index was built from the file as it is now
+    bool describes(const std::string & filename) const;
+    void add_seek_point(int64_t byte_position, int64_t frame);
+    // The last seek point at or before the frame, or NULL
+    const SeekPoint * seek_point(int64_t frame) const;
+    // Frames summarized by an entry of a level
+    int64_t entry_frames(size_t level, int64_t entry) const;
+    Peak entry_peak(size_t level, int64_t entry, int channel) const;
+
+    double sample_rate_;
+    int channels_;
+    int64_t frames_;
+    // The size and modification time of the indexed file
+    int64_t file_size_;
+    int64_t modified_;
+    PeakOptions options_;
+    // The min, max and RMS of each channel of each entry,
+    // scaled to 16 bits, from the finest level to the coarsest
+    std::vector<std::vector<int16_t>> levels_;
+    std::vector<SeekPoint> seek_points_;
+};
+
+int64_t seek_preroll(const AVCodecParameters * codecpar);
 
 void cleanup(
     AVCodecContext * codec_context,
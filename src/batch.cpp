@@ -0,0 +1,167 @@
+#include <vector>
+#include <string>
+#include <mutex>
+#include <functional>
+#include <stdexcept>
+
+#include "audiorw.hpp"
+#include "parallel.hpp"
+
+using namespace audiorw;
+using namespace audiorw::internal;
+
+// Decode a single file, catching any error
+template <typename T>
+static ReadResult<T> read_result(
+    const std::string & filename,
+    const ReadOptions & options) {
+  ReadResult<T> result;
+  result.filename = filename;
+  try {
+    result.audio = read<T>(filename, result.sample_rate, 0, -1, options);
+  } catch (...) {
+    result.error = std::current_exception();
+  }
+  return result;
+}
+
+template <typename T>
+std::vector<ReadResult<T>> audiorw::read_batch(
+    const std::vector<std::string> & filenames,
+    const ReadOptions & options,
+    const BatchOptions & batch) {
+
+  // Each worker writes to its own slot so no locking is needed
+  std::vector<ReadResult<T>> results(filenames.size());
+  parallel_for(filenames.size(), batch.threads, [&](size_t index) {
+    results[index] = read_result<T>(filenames[index], options);
+  });
+
+  return results;
+}
+
+template <typename T>
+void audiorw::read_batch(
+    const std::vector<std::string> & filenames,
+    const typename ReadCallback<T>::type & callback,
+    const ReadOptions & options,
+    const BatchOptions & batch) {
+
+  // Decode in parallel but hand results over one at a time
+  std::mutex callback_mutex;
+  parallel_for(filenames.size(), batch.threads, [&](size_t index) {
+    ReadResult<T> result = read_result<T>(filenames[index], options);
+    std::lock_guard<std::mutex> lock(callback_mutex);
+    callback(index, result);
+  });
+}
+
+template std::vector<ReadResult<int16_t>> audiorw::read_batch<int16_t>(
+    const std::vector<std::string> &, const ReadOptions &, const BatchOptions &);
+template std::vector<ReadResult<int32_t>> audiorw::read_batch<int32_t>(
+    const std::vector<std::string> &, const ReadOptions &, const BatchOptions &);
+template std::vector<ReadResult<float>> audiorw::read_batch<float>(
+    const std::vector<std::string> &, const ReadOptions &, const BatchOptions &);
+template std::vector<ReadResult<double>> audiorw::read_batch<double>(
+    const std::vector<std::string> &, const ReadOptions &, const BatchOptions &);
+
+template void audiorw::read_batch<int16_t>(
+    const std::vector<std::string> &,
+    const ReadCallback<int16_t>::type &,
+    const ReadOptions &, const BatchOptions &);
+template void audiorw::read_batch<int32_t>(
+    const std::vector<std::string> &,
+    const ReadCallback<int32_t>::type &,
+    const ReadOptions &, const BatchOptions &);
+template void audiorw::read_batch<float>(
+    const std::vector<std::string> &,
+    const ReadCallback<float>::type &,
+    const ReadOptions &, const BatchOptions &);
+template void audiorw::read_batch<double>(
+    const std::vector<std::string> &,
+    const ReadCallback<double>::type &,
+    const ReadOptions &, const BatchOptions &);
+
+template <typename T>
+std::vector<WriteResult> audiorw::write_batch(
+    const std::vector<std::vector<std::vector<T>>> & audio,
+    const std::vector<std::string> & filenames,
+    double sample_rate,
+    const WriteOptions & options,
+    const BatchOptions & batch) {
+  if (audio.size() != filenames.size()) {
+    throw std::invalid_argument(
+        "Can not write " + std::to_string(audio.size()) + " clips to " +
+        std::to_string(filenames.size()) + " files");
+  }
+
+  std::vector<WriteResult> results(filenames.size());
+  parallel_for(filenames.size(), batch.threads, [&](size_t index) {
+    results[index].filename = filenames[index];
+    try {
+      write(audio[index], filenames[index], sample_rate, options);
+    } catch (...) {
+      results[index].error = std::current_exception();
+    }
+  });
+
+  return results;
+}
+
+template <typename T>
+std::vector<WriteResult> audiorw::write_batch(
+    const std::vector<std::string> & filenames,
+    const typename WriteSource<T>::type & source,
+    const WriteOptions & options,
+    const BatchOptions & batch) {
+
+  // Each worker fills its own audio, which is freed once it is written
+  std::vector<WriteResult> results(filenames.size());
+  parallel_for(filenames.size(), batch.threads, [&](size_t index) {
+    results[index].filename = filenames[index];
+    try {
+      std::vector<std::vector<T>> audio;
+      double sample_rate = 0;
+      source(index, audio, sample_rate);
+      write(audio, filenames[index], sample_rate, options);
+    } catch (...) {
+      results[index].error = std::current_exception();
+    }
+  });
+
+  return results;
+}
+
+template std::vector<WriteResult> audiorw::write_batch<int16_t>(
+    const std::vector<std::vector<std::vector<int16_t>>> &,
+    const std::vector<std::string> &, double,
+    const WriteOptions &, const BatchOptions &);
+template std::vector<WriteResult> audiorw::write_batch<int32_t>(
+    const std::vector<std::vector<std::vector<int32_t>>> &,
+    const std::vector<std::string> &, double,
+    const WriteOptions &, const BatchOptions &);
+template std::vector<WriteResult> audiorw::write_batch<float>(
+    const std::vector<std::vector<std::vector<float>>> &,
+    const std::vector<std::string> &, double,
+    const WriteOptions &, const BatchOptions &);
+template std::vector<WriteResult> audiorw::write_batch<double>(
+    const std::vector<std::vector<std::vector<double>>> &,
+    const std::vector<std::string> &, double,
+    const WriteOptions &, const BatchOptions &);
+
+template std::vector<WriteResult> audiorw::write_batch<int16_t>(
+    const std::vector<std::string> &,
+    const WriteSource<int16_t>::type &,
+    const WriteOptions &, const BatchOptions &);
+template std::vector<WriteResult> audiorw::write_batch<int32_t>(
+    const std::vector<std::string> &,
+    const WriteSource<int32_t>::type &,
+    const WriteOptions &, const BatchOptions &);
+template std::vector<WriteResult> audiorw::write_batch<float>(
+    const std::vector<std::string> &,
+    const WriteSource<float>::type &,
+    const WriteOptions &, const BatchOptions &);
+template std::vector<WriteResult> audiorw::write_batch<double>(
+    const std::vector<std::string> &,
+    const WriteSource<double>::type &,
+    const WriteOptions &, const BatchOptions &);
@@ -0,0 +1,191 @@
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <utility>
+#include <iterator>
+#include <memory>
+#include <ciso646>
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libswresample/swresample.h>
+};
+
+#include "audiorw.hpp"
+#include "cache.hpp"
+
+using namespace audiorw;
+using namespace audiorw::internal;
+
+DecoderKey::DecoderKey(const AVCodecParameters * codecpar) :
+  codec_id(codecpar -> codec_id),
+  format(codecpar -> format),
+  sample_rate(codecpar -> sample_rate),
+  channels(codecpar -> channels),
+  channel_layout(codecpar -> channel_layout),
+  block_align(codecpar -> block_align),
+  bits_per_coded_sample(codecpar -> bits_per_coded_sample),
+  extradata(codecpar -> extradata, codecpar -> extradata + codecpar -> extradata_size) {
+}
+
+bool DecoderKey::operator==(const DecoderKey & other) const {
+  return
+    codec_id == other.codec_id and
+    format == other.format and
+    sample_rate == other.sample_rate and
+    channels == other.channels and
+    channel_layout == other.channel_layout and
+    block_align == other.block_align and
+    bits_per_coded_sample == other.bits_per_coded_sample and
+    extradata == other.extradata;
+}
+
+bool EncoderKey::operator==(const EncoderKey & other) const {
+  return
+    codec_id == other.codec_id and
+    sample_format == other.sample_format and
+    sample_rate == other.sample_rate and
+    channels == other.channels and
+    channel_layout == other.channel_layout and
+    bit_rate == other.bit_rate and
+    flags == other.flags and
+    quality == other.quality and
+    compression_level == other.compression_level and
+    bits_per_sample == other.bits_per_sample and
+    frame_size == other.frame_size and
+    threads == other.threads and
+    thread_type == other.thread_type and
+    options == other.options;
+}
+
+bool ResamplerKey::operator==(const ResamplerKey & other) const {
+  return
+    input_channel_layout == other.input_channel_layout and
+    input_format == other.input_format and
+    input_sample_rate == other.input_sample_rate and
+    output_channel_layout == other.output_channel_layout and
+    output_format == other.output_format and
+    output_sample_rate == other.output_sample_rate and
+    quality == other.quality;
+}
+
+template <typename Key, typename Context>
+static Context * take(
+    std::deque<std::pair<Key, Context *>> & entries,
+    const Key & key) {
+  for (auto entry = entries.rbegin(); entry != entries.rend(); ++entry) {
+    if (entry -> first == key) {
+      Context * context = entry -> second;
+      entries.erase(std::next(entry).base());
+      return context;
+    }
+  }
+  return NULL;
+}
+
+template <typename Key, typename Context>
+static void give(
+    std::deque<std::pair<Key, Context *>> & entries,
+    const Key & key,
+    Context * context,
+    size_t capacity,
+    void (* free)(Context **)) {
+  entries.emplace_back(key, context);
+  while (entries.size() > capacity) {
+    free(&entries.front().second);
+    entries.pop_front();
+  }
+}
+
+template <typename Key, typename Context>
+static void clear(
+    std::deque<std::pair<Key, Context *>> & entries,
+    void (* free)(Context **)) {
+  for (auto & entry : entries) {
+    free(&entry.second);
+  }
+  entries.clear();
+}
+
+ContextPool::ContextPool(size_t capacity) :
+  capacity_(capacity),
+  frames_(new FramePool()) {
+}
+
+ContextPool::~ContextPool() {
+  clear();
+}
+
+AVCodecContext * ContextPool::take_decoder(const DecoderKey & key) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return take(decoders_, key);
+}
+
+AVCodecContext * ContextPool::take_encoder(const EncoderKey & key) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return take(encoders_, key);
+}
+
+SwrContext * ContextPool::take_resampler(const ResamplerKey & key) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return take(resamplers_, key);
+}
+
+void ContextPool::give_decoder(const DecoderKey & key, AVCodecContext * context) {
+  // Drop any buffered packets and frames
+  avcodec_flush_buffers(context);
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  give(decoders_, key, context, capacity_, &avcodec_free_context);
+}
+
+void ContextPool::give_encoder(const EncoderKey & key, AVCodecContext * context) {
+  // Only some encoders can be reset after they have been drained
+  bool flushable = false;
+#ifdef AV_CODEC_CAP_ENCODER_FLUSH
+  flushable = context -> codec -> capabilities & AV_CODEC_CAP_ENCODER_FLUSH;
+#endif
+  if (not flushable) {
+    avcodec_free_context(&context);
+    return;
+  }
+  avcodec_flush_buffers(context);
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  give(encoders_, key, context, capacity_, &avcodec_free_context);
+}
+
+void ContextPool::give_resampler(const ResamplerKey & key, SwrContext * context) {
+  // Reinitializing clears the buffered samples but
+  // keeps the filters since the parameters are the same
+  if (swr_init(context) < 0) {
+    swr_free(&context);
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  give(resamplers_, key, context, capacity_, &swr_free);
+}
+
+std::shared_ptr<FramePool> ContextPool::frames() const {
+  return frames_;
+}
+
+void ContextPool::clear() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  ::clear(decoders_, &avcodec_free_context);
+  ::clear(encoders_, &avcodec_free_context);
+  ::clear(resamplers_, &swr_free);
+  frames_ -> clear();
+}
+
+ContextCache::ContextCache(size_t capacity) :
+  pool_(new ContextPool(capacity)) {
+}
+
+ContextCache::~ContextCache() {
+}
+
+void ContextCache::clear() {
+  pool_ -> clear();
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <map>
+#include <deque>
+#include <mutex>
+#include <utility>
+#include <memory>
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libswresample/swresample.h>
+};
+
+#include "audiorw.hpp"
+#include "frames.hpp"
+
+namespace audiorw {
+namespace internal {
+
+// The stream parameters a decoder was opened with
+struct DecoderKey {
+  AVCodecID codec_id;
+  int format;
+  int sample_rate;
+  int channels;
+  uint64_t channel_layout;
+  int block_align;
+  int bits_per_coded_sample;
+  // Codecs like Vorbis keep per file setup in here
+  std::vector<uint8_t> extradata;
+
+  explicit DecoderKey(const AVCodecParameters * codecpar);
+  bool operator==(const DecoderKey & other) const;
+};
+
+// The parameters an encoder was opened with
+struct EncoderKey {
+  AVCodecID codec_id;
+  AVSampleFormat sample_format;
+  int sample_rate;
+  int channels;
+  uint64_t channel_layout;
+  int64_t bit_rate;
+  int flags;
+  double quality;
+  int compression_level;
+  int bits_per_sample;
+  int frame_size;
+  int threads;
+  int thread_type;
+  std::map<std::string, std::string> options;
+
+  bool operator==(const EncoderKey & other) const;
+};
+
+// The conversion a resampler was set up for
+struct ResamplerKey {
+  uint64_t input_channel_layout;
+  AVSampleFormat input_format;
+  int input_sample_rate;
+  uint64_t output_channel_layout;
+  AVSampleFormat output_format;
+  int output_sample_rate;
+  ResampleQuality quality;
+
+  bool operator==(const ResamplerKey & other) const;
+};
+
+// Open contexts waiting to be reused. Contexts are taken out while they
+// are in use and given back afterwards, when they are reset. The most
+// recently returned context with matching parameters is taken first
+// and past the capacity the oldest are freed.
+class ContextPool {
+  public:
+    explicit ContextPool(size_t capacity);
+    ~ContextPool();
+
+    ContextPool(const ContextPool &) = delete;
+    ContextPool & operator=(const ContextPool &) = delete;
+
+    // Return NULL if there is nothing with matching parameters
+    AVCodecContext * take_decoder(const DecoderKey & key);
+    AVCodecContext * take_encoder(const EncoderKey & key);
+    SwrContext * take_resampler(const ResamplerKey & key);
+
+    // Encoders that can't be flushed are freed instead
+    void give_decoder(const DecoderKey & key, AVCodecContext * context);
+    void give_encoder(const EncoderKey & key, AVCodecContext * context);
+    void give_resampler(const ResamplerKey & key, SwrContext * context);
+
+    // Sample buffers shared by every reader and writer using the cache
+    std::shared_ptr<FramePool> frames() const;
+
+    void clear();
+
+  private:
+    size_t capacity_;
+    std::mutex mutex_;
+    std::deque<std::pair<DecoderKey, AVCodecContext *>> decoders_;
+    std::deque<std::pair<EncoderKey, AVCodecContext *>> encoders_;
+    std::deque<std::pair<ResamplerKey, SwrContext *>> resamplers_;
+    std::shared_ptr<FramePool> frames_;
+};
+
+}
+}
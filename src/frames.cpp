@@ -0,0 +1,79 @@
+#include <map>
+#include <mutex>
+#include <ciso646>
+
+extern "C" {
+#include <libavutil/frame.h>
+#include <libavutil/buffer.h>
+#include <libavutil/samplefmt.h>
+#include <libavutil/channel_layout.h>
+};
+
+#include "frames.hpp"
+
+using namespace audiorw::internal;
+
+// Pools allocate on the thread asking them for a buffer,
+// which is how get_buffer knows what to count
+static thread_local int64_t * allocation_counter = NULL;
+
+static AVBufferRef * allocate(int size) {
+  if (allocation_counter) (*allocation_counter)++;
+  return av_buffer_alloc(size);
+}
+
+FramePool::FramePool() {
+}
+
+FramePool::~FramePool() {
+  clear();
+}
+
+int FramePool::get_buffer(AVFrame * frame, int64_t * allocations) {
+  if (frame -> channels <= 0) {
+    frame -> channels = av_get_channel_layout_nb_channels(frame -> channel_layout);
+  }
+  AVSampleFormat format = static_cast<AVSampleFormat>(frame -> format);
+  int planes = av_sample_fmt_is_planar(format) ? frame -> channels : 1;
+  if (planes > AV_NUM_DATA_POINTERS) return AVERROR(ENOSYS);
+
+  // The size of each plane, as FFMPEG's own buffers are laid out
+  int linesize;
+  int error = av_samples_get_buffer_size(
+      &linesize, frame -> channels, frame -> nb_samples, format, 0);
+  if (error < 0) return error;
+  int size = 1;
+  while (size < linesize) size <<= 1;
+
+  // Find or make the pool for buffers of this size
+  std::lock_guard<std::mutex> lock(mutex_);
+  AVBufferPool * & pool = pools_[size];
+  if (!pool and !(pool = av_buffer_pool_init(size, &allocate))) {
+    pools_.erase(size);
+    return AVERROR(ENOMEM);
+  }
+
+  // Take a buffer for each plane
+  allocation_counter = allocations;
+  for (int plane = 0; plane < planes; plane++) {
+    if (!(frame -> buf[plane] = av_buffer_pool_get(pool))) {
+      allocation_counter = NULL;
+      av_frame_unref(frame);
+      return AVERROR(ENOMEM);
+    }
+    frame -> data[plane] = frame -> buf[plane] -> data;
+  }
+  allocation_counter = NULL;
+  frame -> extended_data = frame -> data;
+  frame -> linesize[0] = linesize;
+  return 0;
+}
+
+void FramePool::clear() {
+  // Pools are only freed once all of their buffers are back
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (auto & entry : pools_) {
+    av_buffer_pool_uninit(&entry.second);
+  }
+  pools_.clear();
+}
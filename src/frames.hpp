@@ -0,0 +1,42 @@
+#pragma once
+
+#include <map>
+#include <mutex>
+#include <cstdint>
+
+extern "C" {
+#include <libavutil/frame.h>
+#include <libavutil/buffer.h>
+};
+
+namespace audiorw {
+namespace internal {
+
+// Sample buffers for audio frames that go back to the pool when the
+// last reference to them is dropped, rather than being freed. Buffers
+// are grouped by size, rounded up to a power of two so frames of
+// slightly different lengths share them. Safe to use from any thread.
+class FramePool {
+  public:
+    FramePool();
+    ~FramePool();
+
+    FramePool(const FramePool &) = delete;
+    FramePool & operator=(const FramePool &) = delete;
+
+    // Give a frame buffers for its format, channels and number of
+    // samples. Buffers that had to be newly allocated are added to
+    // the counter if one is given. Fails with AVERROR(ENOSYS) for
+    // frames with more planes than fit in AVFrame::buf.
+    int get_buffer(AVFrame * frame, int64_t * allocations=NULL);
+
+    // Free the pooled buffers, those in use are freed when released
+    void clear();
+
+  private:
+    std::mutex mutex_;
+    std::map<int, AVBufferPool *> pools_;
+};
+
+}
+}
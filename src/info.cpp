@@ -0,0 +1,130 @@
+#include <string>
+#include <stdexcept>
+#include <ciso646>
+
+extern "C" {
+#include <libavformat/avformat.h>
+};
+
+#include "audiorw.hpp"
+#include "internal.hpp"
+#include "pcm.hpp"
+
+using namespace audiorw;
+using namespace audiorw::internal;
+
+static AudioInfo describe_pcm(const PcmFormat & format) {
+  AudioInfo info;
+  info.sample_rate = format.sample_rate;
+  info.channels = format.channels;
+  info.channel_layout = format.layout();
+  info.codec_id = format.codec_id();
+  info.codec_name = avcodec_get_name(info.codec_id);
+  info.format_name = format.format_name();
+  info.sample_format = format.sample_format;
+  info.bits_per_sample = format.bits;
+  info.duration = format.frames;
+  info.bit_rate = int64_t(format.sample_rate) * format.block_align() * 8;
+  return info;
+}
+
+static AudioInfo describe_stream(
+    AVFormatContext * format_context,
+    const std::string & filename,
+    const InfoOptions & options) {
+  // Only probe when asked to or when the header is missing something
+  bool probe = options.probe;
+  int audio_stream_index = av_find_best_stream(
+      format_context,
+      AVMEDIA_TYPE_AUDIO,
+      -1, -1, NULL, 0);
+  if (audio_stream_index >= 0) {
+    AVCodecParameters * codecpar = format_context -> streams[audio_stream_index] -> codecpar;
+    probe = probe or codecpar -> sample_rate <= 0 or codecpar -> channels <= 0;
+  }
+
+  if (probe or audio_stream_index < 0) {
+    // Decode no more than needed to find the parameters
+    format_context -> max_analyze_duration = options.probe_seconds * AV_TIME_BASE;
+    int error = avformat_find_stream_info(format_context, NULL);
+    if (error < 0) {
+      throw std::runtime_error(
+          "Could not get information about the stream in file: " + filename + "\n" +
+          error_string(error));
+    }
+    audio_stream_index = av_find_best_stream(
+        format_context,
+        AVMEDIA_TYPE_AUDIO,
+        -1, -1, NULL, 0);
+  }
+  if (audio_stream_index < 0) {
+    throw std::runtime_error(
+        "Could not determine the best stream to use in the file: " + filename);
+  }
+  AVStream * stream = format_context -> streams[audio_stream_index];
+  AVCodecParameters * codecpar = stream -> codecpar;
+
+  AudioInfo info;
+  info.sample_rate = codecpar -> sample_rate;
+  info.channels = codecpar -> channels;
+  info.channel_layout = codecpar -> channel_layout;
+  if (info.channel_layout == 0 and info.channels > 0) {
+    info.channel_layout = av_get_default_channel_layout(info.channels);
+  }
+  info.codec_id = codecpar -> codec_id;
+  info.codec_name = avcodec_get_name(codecpar -> codec_id);
+  info.format_name = format_context -> iformat -> name;
+  info.sample_format = AVSampleFormat(codecpar -> format);
+
+  // Lossless codecs know their raw bit depth, PCM its stored one
+  info.bits_per_sample = codecpar -> bits_per_raw_sample;
+  if (info.bits_per_sample <= 0) {
+    info.bits_per_sample = codecpar -> bits_per_coded_sample;
+  }
+
+  // The stream's duration, or failing that the container's
+  if (codecpar -> sample_rate > 0) {
+    AVRational sample_time_base = av_make_q(1, codecpar -> sample_rate);
+    if (stream -> duration != AV_NOPTS_VALUE) {
+      info.duration = av_rescale_q(stream -> duration, stream -> time_base, sample_time_base);
+    } else if (format_context -> duration != AV_NOPTS_VALUE) {
+      info.duration = av_rescale_q(format_context -> duration, av_make_q(1, AV_TIME_BASE), sample_time_base);
+    }
+  }
+
+  info.bit_rate = codecpar -> bit_rate;
+  if (info.bit_rate <= 0) {
+    info.bit_rate = format_context -> bit_rate;
+  }
+  return info;
+}
+
+AudioInfo audiorw::info(const std::string & filename, const InfoOptions & options) {
+  // Uncompressed headers can be parsed directly. Only the
+  // pages holding the header are read from the mapping.
+  if (options.native_pcm) {
+    PcmFile pcm;
+    if (pcm.open(filename, false)) {
+      return describe_pcm(pcm.format);
+    }
+  }
+
+  // Read the header
+  AVFormatContext * format_context = NULL;
+  int error = avformat_open_input(&format_context, filename.c_str(), NULL, 0);
+  if (error != 0) {
+    throw std::invalid_argument(
+        "Could not open audio file: " + filename + "\n" +
+        error_string(error));
+  }
+
+  AudioInfo info;
+  try {
+    info = describe_stream(format_context, filename, options);
+  } catch (...) {
+    avformat_close_input(&format_context);
+    throw;
+  }
+  avformat_close_input(&format_context);
+  return info;
+}
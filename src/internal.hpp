@@ -0,0 +1,59 @@
+#pragma once
+
+#include <vector>
+#include <string>
+
+extern "C" {
+#include <libavformat/avformat.h>
+};
+
+namespace audiorw {
+namespace internal {
+
+// Format an FFMPEG error code for an exception message
+inline std::string error_string(int error) {
+  char errbuf[AV_ERROR_MAX_STRING_SIZE];
+  av_strerror(error, errbuf, sizeof(errbuf));
+  return "Error: " + std::string(errbuf);
+}
+
+// The packed and planar sample formats of each sample type
+template <typename T> struct SampleFormat;
+template <> struct SampleFormat<int16_t> {
+  static const AVSampleFormat packed = AV_SAMPLE_FMT_S16;
+  static const AVSampleFormat planar = AV_SAMPLE_FMT_S16P;
+};
+template <> struct SampleFormat<int32_t> {
+  static const AVSampleFormat packed = AV_SAMPLE_FMT_S32;
+  static const AVSampleFormat planar = AV_SAMPLE_FMT_S32P;
+};
+template <> struct SampleFormat<float> {
+  static const AVSampleFormat packed = AV_SAMPLE_FMT_FLT;
+  static const AVSampleFormat planar = AV_SAMPLE_FMT_FLTP;
+};
+template <> struct SampleFormat<double> {
+  static const AVSampleFormat packed = AV_SAMPLE_FMT_DBL;
+  static const AVSampleFormat planar = AV_SAMPLE_FMT_DBLP;
+};
+
+// Point planes at the sample offset within audio data of the given format
+inline void offset_planes(
+    uint8_t * const * data,
+    AVSampleFormat format,
+    int channels,
+    int offset,
+    std::vector<uint8_t *> & planes) {
+  int bytes_per_sample = av_get_bytes_per_sample(format);
+  if (av_sample_fmt_is_planar(format)) {
+    planes.resize(channels);
+    for (int channel = 0; channel < channels; channel++) {
+      planes[channel] = data[channel] + offset * bytes_per_sample;
+    }
+  } else {
+    planes.resize(1);
+    planes[0] = data[0] + offset * bytes_per_sample * channels;
+  }
+}
+
+}
+}
@@ -0,0 +1,175 @@
+#include <vector>
+#include <string>
+#include <memory>
+#include <cstring>
+#include <cstdio>
+#include <stdexcept>
+#include <ciso646>
+#include <algorithm>
+
+extern "C" {
+#include <libavformat/avformat.h>
+};
+
+#include "audiorw.hpp"
+#include "io.hpp"
+
+using namespace audiorw;
+using namespace audiorw::internal;
+
+ReadCallbacks audiorw::internal::memory_callbacks(const uint8_t * data, size_t size) {
+  std::shared_ptr<size_t> position(new size_t(0));
+
+  ReadCallbacks callbacks;
+  callbacks.read = [data, size, position](uint8_t * output, size_t count) {
+    count = std::min(count, size - *position);
+    std::memcpy(output, data + *position, count);
+    *position += count;
+    return count;
+  };
+  callbacks.seek = [size, position](int64_t offset) {
+    if (offset < 0 or size_t(offset) > size) return false;
+    *position = offset;
+    return true;
+  };
+  callbacks.size = [size]() {
+    return int64_t(size);
+  };
+  return callbacks;
+}
+
+WriteCallbacks audiorw::internal::vector_callbacks(std::vector<uint8_t> & output) {
+  // Anything already in the vector is kept and written after
+  size_t start = output.size();
+  std::shared_ptr<size_t> position(new size_t(start));
+  std::vector<uint8_t> * vector = &output;
+
+  WriteCallbacks callbacks;
+  callbacks.write = [vector, position](const uint8_t * data, size_t count) {
+    // Overwrite what is there and append the rest
+    size_t end = *position + count;
+    if (end > vector -> size()) vector -> resize(end);
+    std::memcpy(vector -> data() + *position, data, count);
+    *position = end;
+  };
+  callbacks.seek = [vector, position, start](int64_t offset) {
+    if (offset < 0 or start + offset > vector -> size()) return false;
+    *position = start + offset;
+    return true;
+  };
+  return callbacks;
+}
+
+CallbackIO::CallbackIO(const ReadCallbacks & callbacks, int buffer_size) :
+  read_(callbacks),
+  context_(NULL),
+  position_(0) {
+  if (!read_.read) {
+    throw std::invalid_argument("Read callbacks need a read function");
+  }
+  allocate(buffer_size, false, bool(read_.seek));
+}
+
+CallbackIO::CallbackIO(const WriteCallbacks & callbacks, int buffer_size) :
+  write_(callbacks),
+  context_(NULL),
+  position_(0) {
+  if (!write_.write) {
+    throw std::invalid_argument("Write callbacks need a write function");
+  }
+  allocate(buffer_size, true, bool(write_.seek));
+}
+
+CallbackIO::~CallbackIO() {
+  if (context_) {
+    av_freep(&context_ -> buffer);
+    avio_context_free(&context_);
+  }
+}
+
+void CallbackIO::allocate(int buffer_size, bool write, bool seekable) {
+  if (buffer_size <= 0) {
+    throw std::invalid_argument(
+        "Invalid IO buffer size " + std::to_string(buffer_size));
+  }
+
+  // The context takes over the buffer, which it may reallocate
+  uint8_t * buffer = static_cast<uint8_t *>(av_malloc(buffer_size));
+  if (!buffer) {
+    throw std::runtime_error("Could not allocate IO buffer");
+  }
+  context_ = avio_alloc_context(
+      buffer, buffer_size, write, this,
+      write ? NULL : &CallbackIO::read_packet,
+      write ? &CallbackIO::write_packet : NULL,
+      seekable ? &CallbackIO::seek : NULL);
+  if (!context_) {
+    av_free(buffer);
+    throw std::runtime_error("Could not allocate IO context");
+  }
+}
+
+void CallbackIO::rethrow() {
+  if (error_) {
+    std::exception_ptr error = error_;
+    error_ = std::exception_ptr();
+    std::rethrow_exception(error);
+  }
+}
+
+int CallbackIO::read_packet(void * opaque, uint8_t * data, int size) {
+  CallbackIO * io = static_cast<CallbackIO *>(opaque);
+  try {
+    size_t count = io -> read_.read(data, size);
+    if (count == 0) return AVERROR_EOF;
+    io -> position_ += count;
+    return count;
+  } catch (...) {
+    if (!io -> error_) io -> error_ = std::current_exception();
+    return AVERROR(EIO);
+  }
+}
+
+int CallbackIO::write_packet(void * opaque, uint8_t * data, int size) {
+  CallbackIO * io = static_cast<CallbackIO *>(opaque);
+  try {
+    io -> write_.write(data, size);
+    io -> position_ += size;
+    return size;
+  } catch (...) {
+    if (!io -> error_) io -> error_ = std::current_exception();
+    return AVERROR(EIO);
+  }
+}
+
+int64_t CallbackIO::seek(void * opaque, int64_t offset, int whence) {
+  CallbackIO * io = static_cast<CallbackIO *>(opaque);
+  try {
+    const std::function<bool(int64_t)> & seek = io -> read_.seek ? io -> read_.seek : io -> write_.seek;
+    const std::function<int64_t()> & size = io -> read_.size;
+
+    // Only readers can report their size
+    whence &= ~AVSEEK_FORCE;
+    if (whence == AVSEEK_SIZE) {
+      return size ? size() : -1;
+    }
+
+    // Make the offset absolute
+    if (whence == SEEK_CUR) {
+      offset += io -> position_;
+    } else if (whence == SEEK_END) {
+      int64_t end = size ? size() : -1;
+      if (end < 0) return -1;
+      offset += end;
+    } else if (whence != SEEK_SET) {
+      return -1;
+    }
+
+    if (!seek(offset)) return -1;
+    io -> position_ = offset;
+    return offset;
+  } catch (...) {
+    if (!io -> error_) io -> error_ = std::current_exception();
+    return AVERROR(EIO);
+  }
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <exception>
+
+extern "C" {
+#include <libavformat/avformat.h>
+};
+
+#include "audiorw.hpp"
+
+namespace audiorw {
+namespace internal {
+
+// Callbacks that read from a span of memory, which must outlive them
+ReadCallbacks memory_callbacks(const uint8_t * data, size_t size);
+
+// Callbacks that write to a vector, which must outlive them
+WriteCallbacks vector_callbacks(std::vector<uint8_t> & output);
+
+// An AVIOContext that reads or writes through callbacks. Exceptions
+// thrown by the callbacks can't pass through FFMPEG, so they are
+// turned into IO errors and kept to be rethrown afterwards.
+class CallbackIO {
+  public:
+    CallbackIO(const ReadCallbacks & callbacks, int buffer_size);
+    CallbackIO(const WriteCallbacks & callbacks, int buffer_size);
+    ~CallbackIO();
+
+    CallbackIO(const CallbackIO &) = delete;
+    CallbackIO & operator=(const CallbackIO &) = delete;
+
+    AVIOContext * context() { return context_; }
+
+    // Rethrow the first exception thrown by a callback, if there was one
+    void rethrow();
+
+  private:
+    void allocate(int buffer_size, bool write, bool seekable);
+    static int read_packet(void * opaque, uint8_t * data, int size);
+    static int write_packet(void * opaque, uint8_t * data, int size);
+    static int64_t seek(void * opaque, int64_t offset, int whence);
+
+    ReadCallbacks read_;
+    WriteCallbacks write_;
+    AVIOContext * context_;
+    // The byte offset of the callbacks, for relative seeks
+    int64_t position_;
+    std::exception_ptr error_;
+};
+
+}
+}
@@ -0,0 +1,433 @@
+#include <algorithm>
+#include <cmath>
+#include <ciso646>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define AUDIORW_SSE2
+#endif
+
+// AVX2 is compiled in for just the functions that use it and only
+// chosen at runtime if the processor has it
+#if defined(AUDIORW_SSE2) && defined(__GNUC__)
+#include <immintrin.h>
+#define AUDIORW_AVX2
+#define AUDIORW_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+extern "C" {
+#include <libavutil/cpu.h>
+#include <libavutil/samplefmt.h>
+};
+
+#include "pcm.hpp"
+#include "kernels.hpp"
+
+using namespace audiorw::internal;
+
+// Frames converted at a time when interleaving, small enough to stay in cache
+static const size_t QUANTIZE_BLOCK_SIZE = 1024;
+
+// How samples are scaled and clipped before rounding. Dithered
+// samples are rounded to the depth they are stored at and then
+// shifted up into the integer type.
+struct Range {
+  double scale;
+  double min;
+  double max;
+  int shift;
+};
+
+template <typename S>
+static Range range(const Dither * dither) {
+  int bits = 8 * sizeof(S);
+  int shift = dither ? std::max(bits - std::max(dither -> bits, 1), 0) : 0;
+  double scale = std::ldexp(1., bits - 1 - shift);
+  Range limits = {scale, -scale, scale - 1, shift};
+  return limits;
+}
+
+Dither::Dither(int bits, uint32_t seed) :
+  bits(bits) {
+  for (int lane = 0; lane < 8; lane++) {
+    state[lane] = seed + 0x6d2b79f5u * (lane + 1);
+    if (state[lane] == 0) state[lane] = 1;
+  }
+}
+
+// A xorshift generator
+static inline uint32_t next_random(uint32_t & x) {
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return x;
+}
+
+// The sum of two uniform variables, triangular between -1 and 1
+static inline double tpdf(uint32_t & x) {
+  const double scale = 1.0 / (1 << 24);
+  return ((next_random(x) >> 8) + (next_random(x) >> 8)) * scale - 1;
+}
+
+template <typename T, typename S>
+static void quantize_scalar(const T * input, size_t count, S * output, Dither * dither) {
+  if (!dither) {
+    for (size_t i = 0; i < count; i++) {
+      convert_sample(input[i], output[i]);
+    }
+    return;
+  }
+  Range limits = range<S>(dither);
+  int64_t step = int64_t(1) << limits.shift;
+  uint32_t & state = dither -> state[0];
+  for (size_t i = 0; i < count; i++) {
+    double x = input[i] * limits.scale + tpdf(state);
+    x = std::max(std::min(x, limits.max), limits.min);
+    output[i] = S(std::llrint(x) * step);
+  }
+}
+
+#ifdef AUDIORW_SSE2
+// Step every lane's generator and return triangular noise
+static inline __m128 tpdf_sse2(__m128i & state) {
+  const __m128 scale = _mm_set1_ps(1.0f / (1 << 24));
+  __m128 sum = _mm_set1_ps(-1);
+  for (int i = 0; i < 2; i++) {
+    state = _mm_xor_si128(state, _mm_slli_epi32(state, 13));
+    state = _mm_xor_si128(state, _mm_srli_epi32(state, 17));
+    state = _mm_xor_si128(state, _mm_slli_epi32(state, 5));
+    sum = _mm_add_ps(sum, _mm_mul_ps(_mm_cvtepi32_ps(_mm_srli_epi32(state, 8)), scale));
+  }
+  return sum;
+}
+
+static inline void load_pd_sse2(const float * input, __m128d & low, __m128d & high) {
+  __m128 x = _mm_loadu_ps(input);
+  low = _mm_cvtps_pd(x);
+  high = _mm_cvtps_pd(_mm_movehl_ps(x, x));
+}
+
+static inline void load_pd_sse2(const double * input, __m128d & low, __m128d & high) {
+  low = _mm_loadu_pd(input);
+  high = _mm_loadu_pd(input + 2);
+}
+
+// Scale, dither, clip and round 4 samples in double precision
+template <typename T>
+static inline __m128i quantize4_sse2(const T * input, const Range & limits, __m128i * state) {
+  const __m128d scale = _mm_set1_pd(limits.scale);
+  const __m128d minimum = _mm_set1_pd(limits.min);
+  const __m128d maximum = _mm_set1_pd(limits.max);
+  __m128d low, high;
+  load_pd_sse2(input, low, high);
+  low = _mm_mul_pd(low, scale);
+  high = _mm_mul_pd(high, scale);
+  if (state) {
+    __m128 noise = tpdf_sse2(*state);
+    low = _mm_add_pd(low, _mm_cvtps_pd(noise));
+    high = _mm_add_pd(high, _mm_cvtps_pd(_mm_movehl_ps(noise, noise)));
+  }
+  low = _mm_min_pd(_mm_max_pd(low, minimum), maximum);
+  high = _mm_min_pd(_mm_max_pd(high, minimum), maximum);
+  return _mm_sll_epi32(
+      _mm_unpacklo_epi64(_mm_cvtpd_epi32(low), _mm_cvtpd_epi32(high)),
+      _mm_cvtsi32_si128(limits.shift));
+}
+
+// Floats scaled to 16 bits are exact in single precision
+static void quantize_sse2(const float * input, size_t count, int16_t * output, Dither * dither) {
+  Range limits = range<int16_t>(dither);
+  const __m128 scale = _mm_set1_ps(limits.scale);
+  const __m128 minimum = _mm_set1_ps(limits.min);
+  const __m128 maximum = _mm_set1_ps(limits.max);
+  const __m128i shift = _mm_cvtsi32_si128(limits.shift);
+  __m128i state = dither ? _mm_loadu_si128(reinterpret_cast<const __m128i *>(dither -> state)) : _mm_setzero_si128();
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m128 a = _mm_mul_ps(_mm_loadu_ps(input + i), scale);
+    __m128 b = _mm_mul_ps(_mm_loadu_ps(input + i + 4), scale);
+    if (dither) {
+      a = _mm_add_ps(a, tpdf_sse2(state));
+      b = _mm_add_ps(b, tpdf_sse2(state));
+    }
+    a = _mm_min_ps(_mm_max_ps(a, minimum), maximum);
+    b = _mm_min_ps(_mm_max_ps(b, minimum), maximum);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(output + i), _mm_packs_epi32(
+          _mm_sll_epi32(_mm_cvtps_epi32(a), shift), _mm_sll_epi32(_mm_cvtps_epi32(b), shift)));
+  }
+  if (dither) _mm_storeu_si128(reinterpret_cast<__m128i *>(dither -> state), state);
+  quantize_scalar(input + i, count - i, output + i, dither);
+}
+
+static void quantize_sse2(const double * input, size_t count, int16_t * output, Dither * dither) {
+  Range limits = range<int16_t>(dither);
+  __m128i state = dither ? _mm_loadu_si128(reinterpret_cast<const __m128i *>(dither -> state)) : _mm_setzero_si128();
+  __m128i * noise = dither ? &state : NULL;
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m128i a = quantize4_sse2(input + i, limits, noise);
+    __m128i b = quantize4_sse2(input + i + 4, limits, noise);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(output + i), _mm_packs_epi32(a, b));
+  }
+  if (dither) _mm_storeu_si128(reinterpret_cast<__m128i *>(dither -> state), state);
+  quantize_scalar(input + i, count - i, output + i, dither);
+}
+
+template <typename T>
+static void quantize_sse2(const T * input, size_t count, int32_t * output, Dither * dither) {
+  Range limits = range<int32_t>(dither);
+  __m128i state = dither ? _mm_loadu_si128(reinterpret_cast<const __m128i *>(dither -> state)) : _mm_setzero_si128();
+  __m128i * noise = dither ? &state : NULL;
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(output + i), quantize4_sse2(input + i, limits, noise));
+  }
+  if (dither) _mm_storeu_si128(reinterpret_cast<__m128i *>(dither -> state), state);
+  quantize_scalar(input + i, count - i, output + i, dither);
+}
+#endif
+
+#ifdef AUDIORW_AVX2
+AUDIORW_TARGET_AVX2
+static inline __m256 tpdf_avx2(__m256i & state) {
+  const __m256 scale = _mm256_set1_ps(1.0f / (1 << 24));
+  __m256 sum = _mm256_set1_ps(-1);
+  for (int i = 0; i < 2; i++) {
+    state = _mm256_xor_si256(state, _mm256_slli_epi32(state, 13));
+    state = _mm256_xor_si256(state, _mm256_srli_epi32(state, 17));
+    state = _mm256_xor_si256(state, _mm256_slli_epi32(state, 5));
+    sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_srli_epi32(state, 8)), scale));
+  }
+  return sum;
+}
+
+AUDIORW_TARGET_AVX2
+static inline __m256d load_pd_avx2(const float * input) {
+  return _mm256_cvtps_pd(_mm_loadu_ps(input));
+}
+
+AUDIORW_TARGET_AVX2
+static inline __m256d load_pd_avx2(const double * input) {
+  return _mm256_loadu_pd(input);
+}
+
+// Scale, dither, clip and round 8 samples in double precision
+template <typename T>
+AUDIORW_TARGET_AVX2
+static inline void quantize8_avx2(
+    const T * input, const Range & limits, __m256i * state, __m128i & low, __m128i & high) {
+  const __m256d scale = _mm256_set1_pd(limits.scale);
+  const __m256d minimum = _mm256_set1_pd(limits.min);
+  const __m256d maximum = _mm256_set1_pd(limits.max);
+  const __m128i shift = _mm_cvtsi32_si128(limits.shift);
+  __m256d a = _mm256_mul_pd(load_pd_avx2(input), scale);
+  __m256d b = _mm256_mul_pd(load_pd_avx2(input + 4), scale);
+  if (state) {
+    __m256 noise = tpdf_avx2(*state);
+    a = _mm256_add_pd(a, _mm256_cvtps_pd(_mm256_castps256_ps128(noise)));
+    b = _mm256_add_pd(b, _mm256_cvtps_pd(_mm256_extractf128_ps(noise, 1)));
+  }
+  low = _mm_sll_epi32(_mm256_cvtpd_epi32(_mm256_min_pd(_mm256_max_pd(a, minimum), maximum)), shift);
+  high = _mm_sll_epi32(_mm256_cvtpd_epi32(_mm256_min_pd(_mm256_max_pd(b, minimum), maximum)), shift);
+}
+
+AUDIORW_TARGET_AVX2
+static void quantize_avx2(const float * input, size_t count, int16_t * output, Dither * dither) {
+  Range limits = range<int16_t>(dither);
+  const __m256 scale = _mm256_set1_ps(limits.scale);
+  const __m256 minimum = _mm256_set1_ps(limits.min);
+  const __m256 maximum = _mm256_set1_ps(limits.max);
+  const __m128i shift = _mm_cvtsi32_si128(limits.shift);
+  __m256i state = dither ? _mm256_loadu_si256(reinterpret_cast<const __m256i *>(dither -> state)) : _mm256_setzero_si256();
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    __m256 a = _mm256_mul_ps(_mm256_loadu_ps(input + i), scale);
+    __m256 b = _mm256_mul_ps(_mm256_loadu_ps(input + i + 8), scale);
+    if (dither) {
+      a = _mm256_add_ps(a, tpdf_avx2(state));
+      b = _mm256_add_ps(b, tpdf_avx2(state));
+    }
+    a = _mm256_min_ps(_mm256_max_ps(a, minimum), maximum);
+    b = _mm256_min_ps(_mm256_max_ps(b, minimum), maximum);
+    // Packing works within 128 bit lanes, so put the halves back in order
+    __m256i packed = _mm256_packs_epi32(
+        _mm256_sll_epi32(_mm256_cvtps_epi32(a), shift),
+        _mm256_sll_epi32(_mm256_cvtps_epi32(b), shift));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(output + i),
+        _mm256_permute4x64_epi64(packed, 0xD8));
+  }
+  if (dither) _mm256_storeu_si256(reinterpret_cast<__m256i *>(dither -> state), state);
+  quantize_scalar(input + i, count - i, output + i, dither);
+}
+
+AUDIORW_TARGET_AVX2
+static void quantize_avx2(const double * input, size_t count, int16_t * output, Dither * dither) {
+  Range limits = range<int16_t>(dither);
+  __m256i state = dither ? _mm256_loadu_si256(reinterpret_cast<const __m256i *>(dither -> state)) : _mm256_setzero_si256();
+  __m256i * noise = dither ? &state : NULL;
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m128i low, high;
+    quantize8_avx2(input + i, limits, noise, low, high);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(output + i), _mm_packs_epi32(low, high));
+  }
+  if (dither) _mm256_storeu_si256(reinterpret_cast<__m256i *>(dither -> state), state);
+  quantize_scalar(input + i, count - i, output + i, dither);
+}
+
+template <typename T>
+AUDIORW_TARGET_AVX2
+static void quantize_avx2(const T * input, size_t count, int32_t * output, Dither * dither) {
+  Range limits = range<int32_t>(dither);
+  __m256i state = dither ? _mm256_loadu_si256(reinterpret_cast<const __m256i *>(dither -> state)) : _mm256_setzero_si256();
+  __m256i * noise = dither ? &state : NULL;
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m128i low, high;
+    quantize8_avx2(input + i, limits, noise, low, high);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(output + i), low);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(output + i + 4), high);
+  }
+  if (dither) _mm256_storeu_si256(reinterpret_cast<__m256i *>(dither -> state), state);
+  quantize_scalar(input + i, count - i, output + i, dither);
+}
+#endif
+
+// The best instruction set the processor supports, checked once
+enum class InstructionSet {
+  Scalar,
+  SSE2,
+  AVX2
+};
+
+static InstructionSet detect_instruction_set() {
+#ifdef AUDIORW_AVX2
+  if (av_get_cpu_flags() & AV_CPU_FLAG_AVX2) return InstructionSet::AVX2;
+#endif
+#ifdef AUDIORW_SSE2
+  if (av_get_cpu_flags() & AV_CPU_FLAG_SSE2) return InstructionSet::SSE2;
+#endif
+  return InstructionSet::Scalar;
+}
+
+static InstructionSet instruction_set() {
+  static const InstructionSet instruction_set = detect_instruction_set();
+  return instruction_set;
+}
+
+// Quantize a contiguous run of samples
+template <typename T, typename S>
+static void quantize_run(const T * input, size_t count, S * output, Dither * dither) {
+  switch (instruction_set()) {
+#ifdef AUDIORW_AVX2
+    case InstructionSet::AVX2:
+      quantize_avx2(input, count, output, dither);
+      return;
+#endif
+#ifdef AUDIORW_SSE2
+    case InstructionSet::SSE2:
+      quantize_sse2(input, count, output, dither);
+      return;
+#endif
+    default:
+      quantize_scalar(input, count, output, dither);
+  }
+}
+
+template <typename T, typename S>
+static void quantize_frames(
+    const T * const * input,
+    bool input_planar,
+    size_t input_offset,
+    S * const * output,
+    bool output_planar,
+    size_t output_offset,
+    int channels,
+    size_t frames,
+    Dither * dither) {
+  // With the same layout each plane is one run
+  if (channels == 1 or input_planar == output_planar) {
+    if (input_planar) {
+      for (int channel = 0; channel < channels; channel++) {
+        quantize_run(input[channel] + input_offset, frames, output[channel] + output_offset, dither);
+      }
+    } else {
+      quantize_run(input[0] + input_offset * channels, frames * channels,
+          output[0] + output_offset * channels, dither);
+    }
+    return;
+  }
+
+  // Otherwise convert blocks of each channel through scratch space
+  for (size_t done = 0; done < frames; done += QUANTIZE_BLOCK_SIZE) {
+    size_t count = std::min(QUANTIZE_BLOCK_SIZE, frames - done);
+    for (int channel = 0; channel < channels; channel++) {
+      if (input_planar) {
+        S scratch[QUANTIZE_BLOCK_SIZE];
+        quantize_run(input[channel] + input_offset + done, count, scratch, dither);
+        S * samples = output[0] + (output_offset + done) * channels + channel;
+        for (size_t frame = 0; frame < count; frame++) {
+          samples[frame * channels] = scratch[frame];
+        }
+      } else {
+        T scratch[QUANTIZE_BLOCK_SIZE];
+        const T * samples = input[0] + (input_offset + done) * channels + channel;
+        for (size_t frame = 0; frame < count; frame++) {
+          scratch[frame] = samples[frame * channels];
+        }
+        quantize_run(scratch, count, output[channel] + output_offset + done, dither);
+      }
+    }
+  }
+}
+
+template <typename T>
+static void quantize_from(
+    const T * const * input,
+    bool input_planar,
+    size_t input_offset,
+    uint8_t * const * output,
+    AVSampleFormat output_format,
+    size_t output_offset,
+    int channels,
+    size_t frames,
+    Dither * dither) {
+  bool output_planar = av_sample_fmt_is_planar(output_format);
+  if (av_get_packed_sample_fmt(output_format) == AV_SAMPLE_FMT_S16) {
+    quantize_frames(input, input_planar, input_offset,
+        reinterpret_cast<int16_t * const *>(output), output_planar, output_offset,
+        channels, frames, dither);
+  } else {
+    quantize_frames(input, input_planar, input_offset,
+        reinterpret_cast<int32_t * const *>(output), output_planar, output_offset,
+        channels, frames, dither);
+  }
+}
+
+bool audiorw::internal::quantizable(AVSampleFormat input_format, AVSampleFormat output_format) {
+  AVSampleFormat input = av_get_packed_sample_fmt(input_format);
+  AVSampleFormat output = av_get_packed_sample_fmt(output_format);
+  return
+    (input == AV_SAMPLE_FMT_FLT or input == AV_SAMPLE_FMT_DBL) and
+    (output == AV_SAMPLE_FMT_S16 or output == AV_SAMPLE_FMT_S32);
+}
+
+void audiorw::internal::quantize(
+    const uint8_t * const * input,
+    AVSampleFormat input_format,
+    size_t input_offset,
+    uint8_t * const * output,
+    AVSampleFormat output_format,
+    size_t output_offset,
+    int channels,
+    size_t frames,
+    Dither * dither) {
+  bool input_planar = av_sample_fmt_is_planar(input_format);
+  if (av_get_packed_sample_fmt(input_format) == AV_SAMPLE_FMT_FLT) {
+    quantize_from(reinterpret_cast<const float * const *>(input), input_planar, input_offset,
+        output, output_format, output_offset, channels, frames, dither);
+  } else {
+    quantize_from(reinterpret_cast<const double * const *>(input), input_planar, input_offset,
+        output, output_format, output_offset, channels, frames, dither);
+  }
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+extern "C" {
+#include <libavutil/samplefmt.h>
+};
+
+namespace audiorw {
+namespace internal {
+
+// Noise generators for triangular (TPDF) dither, one for each
+// SIMD lane so the vector kernels can run them side by side.
+// The noise is one least significant bit at the depth samples are
+// stored at, e.g. 24 for 32 bit integers whose low byte is dropped.
+struct Dither {
+  int bits;
+  uint32_t state[8];
+
+  explicit Dither(int bits, uint32_t seed=0x9e3779b9);
+};
+
+// Whether quantize can convert from one format to the other, i.e. from
+// packed or planar float or double to packed or planar int16_t or int32_t
+bool quantizable(AVSampleFormat input_format, AVSampleFormat output_format);
+
+// Convert frames of float or double samples to 16 or 32 bit integers
+// in one pass, interleaving or deinterleaving them as the formats need.
+// Samples are rounded and clipped as libswresample would or, if the
+// dither is given, rounded to its depth after adding the noise. Uses
+// AVX2 or SSE2 when the processor has them.
+void quantize(
+    const uint8_t * const * input,
+    AVSampleFormat input_format,
+    size_t input_offset,
+    uint8_t * const * output,
+    AVSampleFormat output_format,
+    size_t output_offset,
+    int channels,
+    size_t frames,
+    Dither * dither);
+
+}
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <exception>
+#include <functional>
+#include <algorithm>
+
+namespace audiorw {
+namespace internal {
+
+// The number of workers to use for the requested number of threads,
+// where zero or less means one per hardware thread
+inline int worker_count(int threads, size_t tasks) {
+  if (threads <= 0) {
+    threads = std::max(int(std::thread::hardware_concurrency()), 1);
+  }
+  return std::max(int(std::min(size_t(threads), tasks)), 1);
+}
+
+// Run task(0) ... task(count - 1) on a pool of worker threads, with each
+// worker taking the next index as soon as it is done with the last.
+// If any task throws, the remaining tasks are skipped and the first
+// exception is rethrown once all of the workers have finished.
+inline void parallel_for(
+    size_t count,
+    int threads,
+    const std::function<void(size_t)> & task) {
+  std::atomic<size_t> next(0);
+  std::exception_ptr error;
+  std::mutex error_mutex;
+
+  auto work = [&]() {
+    size_t index;
+    while ((index = next++) < count) {
+      try {
+        task(index);
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(error_mutex);
+        if (!error) error = std::current_exception();
+        next = count;
+      }
+    }
+  };
+
+  // The calling thread is one of the workers
+  std::vector<std::thread> workers;
+  for (int i = 1; i < worker_count(threads, count); i++) {
+    workers.emplace_back(work);
+  }
+  work();
+  for (std::thread & worker : workers) {
+    worker.join();
+  }
+
+  if (error) std::rethrow_exception(error);
+}
+
+}
+}
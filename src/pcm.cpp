@@ -0,0 +1,1000 @@
+#include <vector>
+#include <string>
+#include <stdexcept>
+#include <ciso646>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+#include <cctype>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#define AUDIORW_MMAP
+#endif
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define AUDIORW_LITTLE_ENDIAN
+#elif defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define AUDIORW_BIG_ENDIAN
+#endif
+
+#if defined(__SSE2__) && defined(AUDIORW_LITTLE_ENDIAN)
+#include <emmintrin.h>
+#define AUDIORW_SSE2
+#endif
+
+extern "C" {
+#include <libavformat/avformat.h>
+};
+
+#include "audiorw.hpp"
+#include "pcm.hpp"
+
+using namespace audiorw;
+using namespace audiorw::internal;
+
+namespace {
+
+// Samples converted at a time when splitting channels, small enough to stay in cache
+static const int PCM_SCRATCH_SIZE = 4096;
+// The most channels swr can handle, anything more goes to FFMPEG
+static const int PCM_MAX_CHANNELS = 64;
+
+// Unaligned integer access of either endianness
+uint16_t get_le16(const uint8_t * p) { return p[0] | p[1] << 8; }
+uint16_t get_be16(const uint8_t * p) { return p[0] << 8 | p[1]; }
+uint32_t get_le32(const uint8_t * p) { return uint32_t(get_le16(p)) | uint32_t(get_le16(p + 2)) << 16; }
+uint32_t get_be32(const uint8_t * p) { return uint32_t(get_be16(p)) << 16 | uint32_t(get_be16(p + 2)); }
+uint64_t get_le64(const uint8_t * p) { return uint64_t(get_le32(p)) | uint64_t(get_le32(p + 4)) << 32; }
+uint64_t get_be64(const uint8_t * p) { return uint64_t(get_be32(p)) << 32 | uint64_t(get_be32(p + 4)); }
+
+void put_le16(uint8_t * p, uint16_t x) { p[0] = x; p[1] = x >> 8; }
+void put_be16(uint8_t * p, uint16_t x) { p[0] = x >> 8; p[1] = x; }
+void put_le32(uint8_t * p, uint32_t x) { put_le16(p, x); put_le16(p + 2, x >> 16); }
+void put_be32(uint8_t * p, uint32_t x) { put_be16(p, x >> 16); put_be16(p + 2, x); }
+void put_le64(uint8_t * p, uint64_t x) { put_le32(p, x); put_le32(p + 4, x >> 32); }
+void put_be64(uint8_t * p, uint64_t x) { put_be32(p, x >> 32); put_be32(p + 4, x); }
+
+// AIFF stores its sample rate as an 80 bit extended float
+double get_extended(const uint8_t * p) {
+  int exponent = (p[0] & 0x7f) << 8 | p[1];
+  uint64_t mantissa = get_be64(p + 2);
+  if (exponent == 0 and mantissa == 0) return 0;
+  double value = std::ldexp(double(mantissa), exponent - 16383 - 63);
+  return (p[0] & 0x80) ? -value : value;
+}
+
+void put_extended(uint8_t * p, uint32_t value) {
+  std::memset(p, 0, 10);
+  if (value == 0) return;
+  uint64_t mantissa = value;
+  int exponent = 16383 + 63;
+  while (!(mantissa >> 63)) {
+    mantissa <<= 1;
+    exponent--;
+  }
+  put_be16(p, exponent);
+  put_be64(p + 2, mantissa);
+}
+
+bool chunk_is(const uint8_t * p, const char * id) {
+  return std::memcmp(p, id, 4) == 0;
+}
+
+// The format FFMPEG decodes stored samples to
+AVSampleFormat decoded_format(int bits, bool floating_point) {
+  if (floating_point) {
+    return bits == 32 ? AV_SAMPLE_FMT_FLT : AV_SAMPLE_FMT_DBL;
+  }
+  switch (bits) {
+    case 8: return AV_SAMPLE_FMT_U8;
+    case 16: return AV_SAMPLE_FMT_S16;
+    default: return AV_SAMPLE_FMT_S32;
+  }
+}
+
+// Check the sample layout is one we can convert and fill in the rest
+bool finish_format(PcmFormat & format, size_t data_size, size_t file_size) {
+  bool valid_bits = format.floating_point ?
+    (format.bits == 32 or format.bits == 64) :
+    (format.bits == 8 or format.bits == 16 or format.bits == 24 or format.bits == 32);
+  if (not valid_bits or
+      format.channels <= 0 or format.channels > PCM_MAX_CHANNELS or
+      format.sample_rate <= 0 or
+      format.data_offset > file_size) {
+    return false;
+  }
+  format.sample_format = decoded_format(format.bits, format.floating_point);
+
+  // Ignore any channel mask that doesn't match the channel count
+  if (av_get_channel_layout_nb_channels(format.channel_layout) != format.channels) {
+    format.channel_layout = 0;
+  }
+
+  // Trust the file size over the header, which may not have been finished
+  data_size = std::min(data_size, file_size - format.data_offset);
+  format.frames = std::min(format.frames, data_size / format.block_align());
+  return true;
+}
+
+bool parse_wav(const uint8_t * data, size_t size, PcmFormat & format) {
+  bool have_format = false;
+  int block_align = 0;
+  size_t position = 12;
+  while (position + 8 <= size) {
+    const uint8_t * chunk = data + position;
+    size_t chunk_size = get_le32(chunk + 4);
+    size_t body = position + 8;
+
+    if (chunk_is(chunk, "fmt ")) {
+      if (chunk_size < 16 or body + chunk_size > size) return false;
+      int tag = get_le16(data + body);
+      format.channels = get_le16(data + body + 2);
+      format.sample_rate = get_le32(data + body + 4);
+      block_align = get_le16(data + body + 12);
+      format.bits = get_le16(data + body + 14);
+      // The extensible format keeps the real tag at the start of its GUID
+      if (tag == 0xfffe) {
+        if (chunk_size < 40) return false;
+        format.channel_layout = get_le32(data + body + 20);
+        tag = get_le16(data + body + 24);
+      }
+      if (tag != 1 and tag != 3) return false;
+      format.floating_point = (tag == 3);
+      have_format = true;
+    } else if (chunk_is(chunk, "data")) {
+      if (not have_format) return false;
+      format.container = PcmFormat::Wav;
+      format.big_endian = false;
+      format.is_unsigned = (format.bits == 8);
+      format.data_offset = body;
+      // Streamed files may leave the size empty
+      if (chunk_size == 0 or chunk_size == 0xffffffff) chunk_size = size - body;
+      format.frames = chunk_size;
+      if (not finish_format(format, chunk_size, size)) return false;
+      return block_align == format.block_align();
+    }
+
+    // Chunks are padded to an even size
+    position = body + chunk_size + (chunk_size & 1);
+  }
+  return false;
+}
+
+bool parse_aiff(const uint8_t * data, size_t size, PcmFormat & format) {
+  bool compressed = chunk_is(data + 8, "AIFC");
+  bool have_format = false;
+  size_t frames = 0;
+  size_t position = 12;
+  while (position + 8 <= size) {
+    const uint8_t * chunk = data + position;
+    size_t chunk_size = get_be32(chunk + 4);
+    size_t body = position + 8;
+
+    if (chunk_is(chunk, "COMM")) {
+      if (chunk_size < 18 or body + chunk_size > size) return false;
+      format.channels = get_be16(data + body);
+      frames = get_be32(data + body + 2);
+      format.bits = (get_be16(data + body + 6) + 7)/8 * 8;
+      format.sample_rate = get_extended(data + body + 8);
+      format.floating_point = false;
+      format.big_endian = true;
+      if (compressed) {
+        if (chunk_size < 22) return false;
+        const uint8_t * type = data + body + 18;
+        if (chunk_is(type, "sowt") and format.bits == 16) {
+          format.big_endian = false;
+        } else if (chunk_is(type, "fl32") or chunk_is(type, "FL32")) {
+          format.floating_point = true;
+          format.bits = 32;
+        } else if (chunk_is(type, "fl64") or chunk_is(type, "FL64")) {
+          format.floating_point = true;
+          format.bits = 64;
+        } else if (not chunk_is(type, "NONE") and not chunk_is(type, "twos")) {
+          return false;
+        }
+      }
+      have_format = true;
+    } else if (chunk_is(chunk, "SSND")) {
+      if (not have_format or body + 8 > size) return false;
+      format.container = PcmFormat::Aiff;
+      format.is_unsigned = false;
+      format.data_offset = body + 8 + get_be32(data + body);
+      format.frames = frames;
+      size_t data_size = chunk_size >= 8 ? chunk_size - 8 : 0;
+      return finish_format(format, data_size, size);
+    }
+
+    position = body + chunk_size + (chunk_size & 1);
+  }
+  return false;
+}
+
+bool parse_au(const uint8_t * data, size_t size, PcmFormat & format) {
+  if (size < 24) return false;
+  format.container = PcmFormat::Au;
+  format.data_offset = get_be32(data + 4);
+  // Samples can't start inside the header, FFMPEG rejects those files
+  if (format.data_offset < 24) return false;
+  size_t data_size = get_be32(data + 8);
+  format.sample_rate = get_be32(data + 16);
+  format.channels = get_be32(data + 20);
+  format.big_endian = true;
+  format.is_unsigned = false;
+  format.floating_point = false;
+
+  // Linear and floating point encodings only
+  switch (get_be32(data + 12)) {
+    case 2: format.bits = 8; break;
+    case 3: format.bits = 16; break;
+    case 4: format.bits = 24; break;
+    case 5: format.bits = 32; break;
+    case 6: format.bits = 32; format.floating_point = true; break;
+    case 7: format.bits = 64; format.floating_point = true; break;
+    default: return false;
+  }
+  if (data_size == 0xffffffff) data_size = size;
+  format.frames = data_size;
+  return finish_format(format, data_size, size);
+}
+
+// Loaders for each way samples are stored, giving
+// the sample FFMPEG's decoder would produce
+struct LoadU8 {
+  typedef uint8_t type;
+  static const int size = 1;
+  static type load(const uint8_t * p) { return p[0]; }
+};
+struct LoadS8 {
+  typedef uint8_t type;
+  static const int size = 1;
+  static type load(const uint8_t * p) { return p[0] ^ 0x80; }
+};
+struct LoadS16LE {
+  typedef int16_t type;
+  static const int size = 2;
+  static type load(const uint8_t * p) { return get_le16(p); }
+};
+struct LoadS16BE {
+  typedef int16_t type;
+  static const int size = 2;
+  static type load(const uint8_t * p) { return get_be16(p); }
+};
+struct LoadS24LE {
+  typedef int32_t type;
+  static const int size = 3;
+  static type load(const uint8_t * p) { return uint32_t(p[0]) << 8 | uint32_t(p[1]) << 16 | uint32_t(p[2]) << 24; }
+};
+struct LoadS24BE {
+  typedef int32_t type;
+  static const int size = 3;
+  static type load(const uint8_t * p) { return uint32_t(p[2]) << 8 | uint32_t(p[1]) << 16 | uint32_t(p[0]) << 24; }
+};
+struct LoadS32LE {
+  typedef int32_t type;
+  static const int size = 4;
+  static type load(const uint8_t * p) { return get_le32(p); }
+};
+struct LoadS32BE {
+  typedef int32_t type;
+  static const int size = 4;
+  static type load(const uint8_t * p) { return get_be32(p); }
+};
+struct LoadF32LE {
+  typedef float type;
+  static const int size = 4;
+  static type load(const uint8_t * p) { uint32_t x = get_le32(p); float y; std::memcpy(&y, &x, 4); return y; }
+};
+struct LoadF32BE {
+  typedef float type;
+  static const int size = 4;
+  static type load(const uint8_t * p) { uint32_t x = get_be32(p); float y; std::memcpy(&y, &x, 4); return y; }
+};
+struct LoadF64LE {
+  typedef double type;
+  static const int size = 8;
+  static type load(const uint8_t * p) { uint64_t x = get_le64(p); double y; std::memcpy(&y, &x, 8); return y; }
+};
+struct LoadF64BE {
+  typedef double type;
+  static const int size = 8;
+  static type load(const uint8_t * p) { uint64_t x = get_be64(p); double y; std::memcpy(&y, &x, 8); return y; }
+};
+
+// Convert contiguous samples, written so the compiler can vectorize it
+template <typename Load, typename T>
+void convert_samples(const uint8_t * source, size_t count, T * output) {
+  for (size_t i = 0; i < count; i++) {
+    convert_sample(Load::load(source + i * Load::size), output[i]);
+  }
+}
+
+// Specialized below where there is a faster way
+template <typename Load, typename T>
+void decode_samples(const uint8_t * source, size_t count, T * output) {
+  convert_samples<Load>(source, count, output);
+}
+
+#ifdef AUDIORW_LITTLE_ENDIAN
+// Samples that are already in the output format are copied
+template <>
+void decode_samples<LoadS16LE, int16_t>(const uint8_t * source, size_t count, int16_t * output) {
+  std::memcpy(output, source, count * sizeof(int16_t));
+}
+template <>
+void decode_samples<LoadS32LE, int32_t>(const uint8_t * source, size_t count, int32_t * output) {
+  std::memcpy(output, source, count * sizeof(int32_t));
+}
+template <>
+void decode_samples<LoadF32LE, float>(const uint8_t * source, size_t count, float * output) {
+  std::memcpy(output, source, count * sizeof(float));
+}
+template <>
+void decode_samples<LoadF64LE, double>(const uint8_t * source, size_t count, double * output) {
+  std::memcpy(output, source, count * sizeof(double));
+}
+#endif
+
+#ifdef AUDIORW_SSE2
+// Sign extend 8 int16_t to two vectors of 4 int32_t
+inline void widen_s16(__m128i x, __m128i & low, __m128i & high) {
+  low = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+  high = _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16);
+}
+
+template <>
+void decode_samples<LoadS16LE, float>(const uint8_t * source, size_t count, float * output) {
+  const __m128 scale = _mm_set1_ps(1.0f / (1 << 15));
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m128i low, high;
+    widen_s16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(source + 2 * i)), low, high);
+    _mm_storeu_ps(output + i, _mm_mul_ps(_mm_cvtepi32_ps(low), scale));
+    _mm_storeu_ps(output + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(high), scale));
+  }
+  convert_samples<LoadS16LE>(source + 2 * i, count - i, output + i);
+}
+
+template <>
+void decode_samples<LoadS16LE, double>(const uint8_t * source, size_t count, double * output) {
+  const __m128d scale = _mm_set1_pd(1.0 / (1 << 15));
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m128i low, high;
+    widen_s16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(source + 2 * i)), low, high);
+    _mm_storeu_pd(output + i, _mm_mul_pd(_mm_cvtepi32_pd(low), scale));
+    _mm_storeu_pd(output + i + 2, _mm_mul_pd(_mm_cvtepi32_pd(_mm_srli_si128(low, 8)), scale));
+    _mm_storeu_pd(output + i + 4, _mm_mul_pd(_mm_cvtepi32_pd(high), scale));
+    _mm_storeu_pd(output + i + 6, _mm_mul_pd(_mm_cvtepi32_pd(_mm_srli_si128(high, 8)), scale));
+  }
+  convert_samples<LoadS16LE>(source + 2 * i, count - i, output + i);
+}
+
+template <>
+void decode_samples<LoadS32LE, float>(const uint8_t * source, size_t count, float * output) {
+  const __m128 scale = _mm_set1_ps(1.0f / (1U << 31));
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(source + 4 * i));
+    _mm_storeu_ps(output + i, _mm_mul_ps(_mm_cvtepi32_ps(x), scale));
+  }
+  convert_samples<LoadS32LE>(source + 4 * i, count - i, output + i);
+}
+
+template <>
+void decode_samples<LoadS32LE, double>(const uint8_t * source, size_t count, double * output) {
+  const __m128d scale = _mm_set1_pd(1.0 / (1U << 31));
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(source + 4 * i));
+    _mm_storeu_pd(output + i, _mm_mul_pd(_mm_cvtepi32_pd(x), scale));
+    _mm_storeu_pd(output + i + 2, _mm_mul_pd(_mm_cvtepi32_pd(_mm_srli_si128(x, 8)), scale));
+  }
+  convert_samples<LoadS32LE>(source + 4 * i, count - i, output + i);
+}
+
+template <>
+void decode_samples<LoadF32LE, double>(const uint8_t * source, size_t count, double * output) {
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128 x = _mm_loadu_ps(reinterpret_cast<const float *>(source + 4 * i));
+    _mm_storeu_pd(output + i, _mm_cvtps_pd(x));
+    _mm_storeu_pd(output + i + 2, _mm_cvtps_pd(_mm_movehl_ps(x, x)));
+  }
+  convert_samples<LoadF32LE>(source + 4 * i, count - i, output + i);
+}
+#endif
+
+// Pick the loader for the stored format
+template <typename T>
+void decode_format(const PcmFormat & format, const uint8_t * source, size_t count, T * output) {
+  if (format.floating_point) {
+    if (format.bits == 32) {
+      if (format.big_endian) decode_samples<LoadF32BE>(source, count, output);
+      else decode_samples<LoadF32LE>(source, count, output);
+    } else {
+      if (format.big_endian) decode_samples<LoadF64BE>(source, count, output);
+      else decode_samples<LoadF64LE>(source, count, output);
+    }
+    return;
+  }
+  switch (format.bits) {
+    case 8:
+      if (format.is_unsigned) decode_samples<LoadU8>(source, count, output);
+      else decode_samples<LoadS8>(source, count, output);
+      break;
+    case 16:
+      if (format.big_endian) decode_samples<LoadS16BE>(source, count, output);
+      else decode_samples<LoadS16LE>(source, count, output);
+      break;
+    case 24:
+      if (format.big_endian) decode_samples<LoadS24BE>(source, count, output);
+      else decode_samples<LoadS24LE>(source, count, output);
+      break;
+    default:
+      if (format.big_endian) decode_samples<LoadS32BE>(source, count, output);
+      else decode_samples<LoadS32LE>(source, count, output);
+  }
+}
+
+template <typename T>
+void decode_frames(
+    const PcmFormat & format,
+    const uint8_t * source,
+    size_t frames,
+    uint8_t * const * output,
+    bool planar) {
+  int channels = format.channels;
+  if (not planar or channels == 1) {
+    decode_format(format, source, frames * channels, reinterpret_cast<T *>(output[0]));
+    return;
+  }
+
+  // Convert a block at a time and then split it into channels
+  T scratch[PCM_SCRATCH_SIZE];
+  size_t block = PCM_SCRATCH_SIZE/channels;
+  for (size_t done = 0; done < frames; done += block) {
+    size_t count = std::min(block, frames - done);
+    decode_format(format, source + done * format.block_align(), count * channels, scratch);
+    for (int channel = 0; channel < channels; channel++) {
+      T * plane = reinterpret_cast<T *>(output[channel]) + done;
+      for (size_t frame = 0; frame < count; frame++) {
+        plane[frame] = scratch[frame * channels + channel];
+      }
+    }
+  }
+}
+
+// Storers for each way samples can be stored, taking
+// the sample FFMPEG's encoder would be given
+struct StoreS16LE {
+  typedef int16_t type;
+  static const int size = 2;
+  static void store(uint8_t * p, type x) { put_le16(p, x); }
+};
+struct StoreS16BE {
+  typedef int16_t type;
+  static const int size = 2;
+  static void store(uint8_t * p, type x) { put_be16(p, x); }
+};
+struct StoreS24LE {
+  typedef int32_t type;
+  static const int size = 3;
+  static void store(uint8_t * p, type x) { p[0] = x >> 8; p[1] = x >> 16; p[2] = x >> 24; }
+};
+struct StoreS24BE {
+  typedef int32_t type;
+  static const int size = 3;
+  static void store(uint8_t * p, type x) { p[2] = x >> 8; p[1] = x >> 16; p[0] = x >> 24; }
+};
+struct StoreS32LE {
+  typedef int32_t type;
+  static const int size = 4;
+  static void store(uint8_t * p, type x) { put_le32(p, x); }
+};
+struct StoreS32BE {
+  typedef int32_t type;
+  static const int size = 4;
+  static void store(uint8_t * p, type x) { put_be32(p, x); }
+};
+struct StoreF32LE {
+  typedef float type;
+  static const int size = 4;
+  static void store(uint8_t * p, type x) { uint32_t y; std::memcpy(&y, &x, 4); put_le32(p, y); }
+};
+struct StoreF32BE {
+  typedef float type;
+  static const int size = 4;
+  static void store(uint8_t * p, type x) { uint32_t y; std::memcpy(&y, &x, 4); put_be32(p, y); }
+};
+struct StoreF64LE {
+  typedef double type;
+  static const int size = 8;
+  static void store(uint8_t * p, type x) { uint64_t y; std::memcpy(&y, &x, 8); put_le64(p, y); }
+};
+struct StoreF64BE {
+  typedef double type;
+  static const int size = 8;
+  static void store(uint8_t * p, type x) { uint64_t y; std::memcpy(&y, &x, 8); put_be64(p, y); }
+};
+
+// Convert and interleave frames from packed or planar input
+template <typename Store, typename T>
+void encode_frames(
+    const T * const * input,
+    bool planar,
+    int channels,
+    size_t offset,
+    size_t frames,
+    uint8_t * output) {
+  typename Store::type sample;
+  if (not planar or channels == 1) {
+    const T * samples = input[0] + offset * channels;
+    for (size_t i = 0; i < frames * channels; i++) {
+      convert_sample(samples[i], sample);
+      Store::store(output + i * Store::size, sample);
+    }
+    return;
+  }
+  for (size_t frame = 0; frame < frames; frame++) {
+    for (int channel = 0; channel < channels; channel++) {
+      convert_sample(input[channel][offset + frame], sample);
+      Store::store(output, sample);
+      output += Store::size;
+    }
+  }
+}
+
+// Pick the storer for the stored format
+template <typename T>
+void encode_frames(
+    const PcmFormat & format,
+    const T * const * input,
+    bool planar,
+    size_t offset,
+    size_t frames,
+    uint8_t * output) {
+  int channels = format.channels;
+  if (format.floating_point) {
+    if (format.bits == 32) {
+      if (format.big_endian) encode_frames<StoreF32BE>(input, planar, channels, offset, frames, output);
+      else encode_frames<StoreF32LE>(input, planar, channels, offset, frames, output);
+    } else {
+      if (format.big_endian) encode_frames<StoreF64BE>(input, planar, channels, offset, frames, output);
+      else encode_frames<StoreF64LE>(input, planar, channels, offset, frames, output);
+    }
+    return;
+  }
+  switch (format.bits) {
+    case 16:
+      if (format.big_endian) encode_frames<StoreS16BE>(input, planar, channels, offset, frames, output);
+      else encode_frames<StoreS16LE>(input, planar, channels, offset, frames, output);
+      break;
+    case 24:
+      if (format.big_endian) encode_frames<StoreS24BE>(input, planar, channels, offset, frames, output);
+      else encode_frames<StoreS24LE>(input, planar, channels, offset, frames, output);
+      break;
+    default:
+      if (format.big_endian) encode_frames<StoreS32BE>(input, planar, channels, offset, frames, output);
+      else encode_frames<StoreS32LE>(input, planar, channels, offset, frames, output);
+  }
+}
+
+}
+
+AVCodecID PcmFormat::codec_id() const {
+  if (floating_point) {
+    if (bits == 32) return big_endian ? AV_CODEC_ID_PCM_F32BE : AV_CODEC_ID_PCM_F32LE;
+    return big_endian ? AV_CODEC_ID_PCM_F64BE : AV_CODEC_ID_PCM_F64LE;
+  }
+  switch (bits) {
+    case 8: return is_unsigned ? AV_CODEC_ID_PCM_U8 : AV_CODEC_ID_PCM_S8;
+    case 16: return big_endian ? AV_CODEC_ID_PCM_S16BE : AV_CODEC_ID_PCM_S16LE;
+    case 24: return big_endian ? AV_CODEC_ID_PCM_S24BE : AV_CODEC_ID_PCM_S24LE;
+    default: return big_endian ? AV_CODEC_ID_PCM_S32BE : AV_CODEC_ID_PCM_S32LE;
+  }
+}
+
+uint64_t PcmFormat::layout() const {
+  if (channel_layout != 0) return channel_layout;
+  return av_get_default_channel_layout(channels);
+}
+
+const char * PcmFormat::format_name() const {
+  switch (container) {
+    case Wav: return "wav";
+    case Aiff: return "aiff";
+    default: return "au";
+  }
+}
+
+bool audiorw::internal::parse_pcm_header(const uint8_t * data, size_t size, PcmFormat & format) {
+  if (size < 12) return false;
+  format.channel_layout = 0;
+  if (chunk_is(data, "RIFF") and chunk_is(data + 8, "WAVE")) {
+    return parse_wav(data, size, format);
+  } else if (chunk_is(data, "FORM") and (chunk_is(data + 8, "AIFF") or chunk_is(data + 8, "AIFC"))) {
+    return parse_aiff(data, size, format);
+  } else if (chunk_is(data, ".snd")) {
+    return parse_au(data, size, format);
+  }
+  return false;
+}
+
+bool audiorw::internal::needs_conversion(const PcmFormat & format, const ReadOptions & options) {
+  if (options.sample_rate > 0 and options.sample_rate != format.sample_rate) {
+    return true;
+  }
+  if (options.channel_layout != 0) {
+    return options.channel_layout != format.layout();
+  }
+  return options.channels > 0 and
+    uint64_t(av_get_default_channel_layout(options.channels)) != format.layout();
+}
+
+bool audiorw::internal::pcm_viewable(const PcmFormat & format, AVSampleFormat sample_format) {
+#if defined(AUDIORW_LITTLE_ENDIAN)
+  bool native_endian = not format.big_endian;
+#elif defined(AUDIORW_BIG_ENDIAN)
+  bool native_endian = format.big_endian;
+#else
+  bool native_endian = false;
+#endif
+  // 8 and 24 bit samples have no matching type, and the
+  // samples have to be aligned to be accessed in place
+  return native_endian and
+    format.bits != 8 and format.bits != 24 and
+    format.sample_format == sample_format and
+    format.data_offset % (format.bits/8) == 0;
+}
+
+bool audiorw::internal::pcm_container(const std::string & filename, PcmFormat::Container & container) {
+  size_t dot = filename.rfind('.');
+  if (dot == std::string::npos) return false;
+  std::string extension = filename.substr(dot + 1);
+  std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+  if (extension == "wav") {
+    container = PcmFormat::Wav;
+  } else if (extension == "aif" or extension == "aiff") {
+    container = PcmFormat::Aiff;
+  } else if (extension == "au") {
+    container = PcmFormat::Au;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+PcmFormat audiorw::internal::pcm_format(
+    PcmFormat::Container container,
+    int sample_rate,
+    int channels,
+    int bits,
+    bool floating_point) {
+  PcmFormat format;
+  format.container = container;
+  format.sample_format = decoded_format(bits, floating_point);
+  format.bits = bits;
+  format.floating_point = floating_point;
+  format.big_endian = (container != PcmFormat::Wav);
+  format.is_unsigned = false;
+  format.channels = channels;
+  format.sample_rate = sample_rate;
+  format.channel_layout = av_get_default_channel_layout(channels);
+  format.data_offset = 0;
+  format.frames = 0;
+  return format;
+}
+
+MappedFile::MappedFile() :
+  data_(NULL),
+  size_(0) {
+}
+
+MappedFile::~MappedFile() {
+#ifdef AUDIORW_MMAP
+  if (data_) munmap(const_cast<uint8_t *>(data_), size_);
+#endif
+}
+
+bool MappedFile::open(const std::string & filename, bool sequential) {
+#ifdef AUDIORW_MMAP
+  int fd = ::open(filename.c_str(), O_RDONLY);
+  if (fd < 0) return false;
+
+  // Only regular files can be mapped
+  struct stat status;
+  if (fstat(fd, &status) != 0 or not S_ISREG(status.st_mode) or status.st_size <= 0) {
+    ::close(fd);
+    return false;
+  }
+
+  // The mapping stays valid after the descriptor is closed
+  void * data = mmap(NULL, status.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (data == MAP_FAILED) return false;
+#ifdef MADV_SEQUENTIAL
+  if (sequential) madvise(data, status.st_size, MADV_SEQUENTIAL);
+#endif
+
+  data_ = static_cast<const uint8_t *>(data);
+  size_ = status.st_size;
+  return true;
+#else
+  (void) filename;
+  (void) sequential;
+  return false;
+#endif
+}
+
+bool PcmFile::open(const std::string & filename, bool sequential) {
+  return file.open(filename, sequential) and open(file.data(), file.size());
+}
+
+bool PcmFile::open(const uint8_t * data, size_t size) {
+  this -> data = data;
+  this -> size = size;
+  return parse_pcm_header(data, size, format);
+}
+
+void audiorw::internal::decode_pcm(
+    const PcmFormat & format,
+    const uint8_t * source,
+    size_t frames,
+    uint8_t * const * output,
+    AVSampleFormat output_format) {
+  bool planar = av_sample_fmt_is_planar(output_format);
+  switch (av_get_packed_sample_fmt(output_format)) {
+    case AV_SAMPLE_FMT_S16:
+      decode_frames<int16_t>(format, source, frames, output, planar);
+      break;
+    case AV_SAMPLE_FMT_S32:
+      decode_frames<int32_t>(format, source, frames, output, planar);
+      break;
+    case AV_SAMPLE_FMT_FLT:
+      decode_frames<float>(format, source, frames, output, planar);
+      break;
+    case AV_SAMPLE_FMT_DBL:
+      decode_frames<double>(format, source, frames, output, planar);
+      break;
+    default:
+      throw std::invalid_argument("Unsupported output sample format");
+  }
+}
+
+PcmWriter::PcmWriter() :
+  file_(NULL),
+  buffered_(0) {
+}
+
+PcmWriter::~PcmWriter() {
+  if (file_) fclose(file_);
+}
+
+void PcmWriter::open(const std::string & filename, const PcmFormat & format, bool dither) {
+  filename_ = filename;
+  format_ = format;
+  dither_.reset(dither and not format_.floating_point ? new Dither(format_.bits) : NULL);
+  if (format_.sample_rate <= 0) {
+    throw std::invalid_argument(
+        "Can not write audio with sample rate " + std::to_string(format_.sample_rate) +
+        " to file: " + filename_);
+  }
+
+  if (!(file_ = fopen(filename_.c_str(), "wb"))) {
+    throw std::invalid_argument(
+        "Could not open file:" + filename_);
+  }
+
+  // Samples are gathered into whole frames and written in large chunks
+  size_t frame_size = format_.block_align();
+  buffer_.resize(std::max(PCM_WRITE_BUFFER_SIZE/frame_size, size_t(1)) * frame_size);
+  buffered_ = 0;
+
+  // Dithered samples that can't be quantized in place are staged as
+  // 16 or 32 bit integers, as many as the buffer holds
+  if (dither_) {
+    size_t sample_size = format_.bits == 16 ? sizeof(int16_t) : sizeof(int32_t);
+    quantized_.resize(buffer_.size()/frame_size * format_.channels * sample_size);
+  }
+
+  // Write a header with no samples, which close fills in
+  format_.frames = 0;
+  write_header();
+}
+
+void PcmWriter::write(
+    const uint8_t * const * input,
+    AVSampleFormat input_format,
+    size_t frames) {
+  bool planar = av_sample_fmt_is_planar(input_format);
+  size_t frame_size = format_.block_align();
+
+  // Floats stored as native 16 or 32 bit integers go through the vector
+  // kernels. Dithered floats stored any other way, e.g. as 24 bit or
+  // big endian integers, are quantized first and stored from there.
+  AVSampleFormat quantized_format = AV_SAMPLE_FMT_NONE;
+  bool in_place = false;
+  if (not format_.floating_point and not format_.is_unsigned) {
+    quantized_format = format_.bits == 16 ? AV_SAMPLE_FMT_S16 : AV_SAMPLE_FMT_S32;
+#ifdef AUDIORW_LITTLE_ENDIAN
+    in_place = not format_.big_endian and format_.bits != 24;
+#endif
+  }
+  bool quantize_input = quantizable(input_format, quantized_format) and (in_place or dither_);
+
+  size_t written = 0;
+  while (written < frames) {
+    if (buffered_ == buffer_.size()) flush();
+    size_t count = std::min(frames - written, (buffer_.size() - buffered_)/frame_size);
+    uint8_t * output = buffer_.data() + buffered_;
+
+    if (quantize_input and in_place) {
+      quantize(input, input_format, written, &output, quantized_format, 0,
+          format_.channels, count, dither_.get());
+    } else if (quantize_input) {
+      uint8_t * samples = quantized_.data();
+      quantize(input, input_format, written, &samples, quantized_format, 0,
+          format_.channels, count, dither_.get());
+      if (quantized_format == AV_SAMPLE_FMT_S16) {
+        encode_frames(format_, reinterpret_cast<const int16_t * const *>(&samples), false, 0, count, output);
+      } else {
+        encode_frames(format_, reinterpret_cast<const int32_t * const *>(&samples), false, 0, count, output);
+      }
+    } else {
+      switch (av_get_packed_sample_fmt(input_format)) {
+        case AV_SAMPLE_FMT_S16:
+          encode_frames(format_, reinterpret_cast<const int16_t * const *>(input), planar, written, count, output);
+          break;
+        case AV_SAMPLE_FMT_S32:
+          encode_frames(format_, reinterpret_cast<const int32_t * const *>(input), planar, written, count, output);
+          break;
+        case AV_SAMPLE_FMT_FLT:
+          encode_frames(format_, reinterpret_cast<const float * const *>(input), planar, written, count, output);
+          break;
+        case AV_SAMPLE_FMT_DBL:
+          encode_frames(format_, reinterpret_cast<const double * const *>(input), planar, written, count, output);
+          break;
+        default:
+          throw std::invalid_argument(
+              "Unsupported input sample format for file: " + filename_);
+      }
+    }
+
+    buffered_ += count * frame_size;
+    written += count;
+    format_.frames += count;
+  }
+}
+
+void PcmWriter::flush() {
+  if (buffered_ > 0 and fwrite(buffer_.data(), 1, buffered_, file_) != buffered_) {
+    throw std::runtime_error(
+        "Could not write to file: " + filename_);
+  }
+  buffered_ = 0;
+}
+
+void PcmWriter::close() {
+  flush();
+
+  // Chunks are padded to an even size
+  uint8_t padding = 0;
+  size_t data_size = format_.frames * format_.block_align();
+  if (format_.container != PcmFormat::Au and (data_size & 1)) {
+    if (fwrite(&padding, 1, 1, file_) != 1) {
+      throw std::runtime_error(
+          "Could not write to file: " + filename_);
+    }
+  }
+
+  // Go back and fill in the sizes
+  if (fseek(file_, 0, SEEK_SET) != 0) {
+    throw std::runtime_error(
+        "Could not seek in file: " + filename_);
+  }
+  write_header();
+
+  FILE * file = file_;
+  file_ = NULL;
+  if (fclose(file) != 0) {
+    throw std::runtime_error(
+        "Could not close file: " + filename_);
+  }
+}
+
+void PcmWriter::write_header() {
+  // Sizes past 4GB can't be represented so they are clipped
+  uint64_t data_size = uint64_t(format_.frames) * format_.block_align();
+  uint32_t size = std::min(data_size, uint64_t(0xfffffff0));
+  uint32_t padded_size = size + (size & 1);
+  std::vector<uint8_t> header;
+
+  if (format_.container == PcmFormat::Wav) {
+    // Use the extensible format for anything other than basic integer PCM
+    bool extensible = format_.channels > 2 or format_.bits > 16 or format_.floating_point;
+    int tag = format_.floating_point ? 3 : 1;
+    uint32_t format_size = extensible ? 40 : 16;
+    header.resize(12 + 8 + format_size + 8);
+    uint8_t * p = header.data();
+    std::memcpy(p, "RIFF", 4);
+    put_le32(p + 4, header.size() - 8 + padded_size);
+    std::memcpy(p + 8, "WAVE", 4);
+    std::memcpy(p + 12, "fmt ", 4);
+    put_le32(p + 16, format_size);
+    p += 20;
+    put_le16(p, extensible ? 0xfffe : tag);
+    put_le16(p + 2, format_.channels);
+    put_le32(p + 4, format_.sample_rate);
+    put_le32(p + 8, format_.sample_rate * format_.block_align());
+    put_le16(p + 12, format_.block_align());
+    put_le16(p + 14, format_.bits);
+    if (extensible) {
+      static const uint8_t guid[14] = {
+        0x00, 0x00, 0x00, 0x00, 0x10, 0x00, 0x80, 0x00, 0x00, 0xaa, 0x00, 0x38, 0x9b, 0x71};
+      put_le16(p + 16, 22);
+      put_le16(p + 18, format_.bits);
+      put_le32(p + 20, format_.channel_layout);
+      put_le16(p + 24, tag);
+      std::memcpy(p + 26, guid, sizeof(guid));
+    }
+    p += format_size;
+    std::memcpy(p, "data", 4);
+    put_le32(p + 4, size);
+  } else if (format_.container == PcmFormat::Aiff) {
+    // Floating point samples need the AIFF-C variant
+    bool compressed = format_.floating_point;
+    uint32_t common_size = compressed ? 24 : 18;
+    size_t version_size = compressed ? 12 : 0;
+    header.resize(12 + version_size + 8 + common_size + 16);
+    uint8_t * p = header.data();
+    std::memcpy(p, "FORM", 4);
+    put_be32(p + 4, header.size() - 8 + padded_size);
+    std::memcpy(p + 8, compressed ? "AIFC" : "AIFF", 4);
+    p += 12;
+    if (compressed) {
+      std::memcpy(p, "FVER", 4);
+      put_be32(p + 4, 4);
+      put_be32(p + 8, 0xa2805140);
+      p += 12;
+    }
+    std::memcpy(p, "COMM", 4);
+    put_be32(p + 4, common_size);
+    put_be16(p + 8, format_.channels);
+    put_be32(p + 10, std::min(format_.frames, size_t(0xffffffff)));
+    put_be16(p + 14, format_.bits);
+    put_extended(p + 16, format_.sample_rate);
+    if (compressed) {
+      std::memcpy(p + 26, format_.bits == 32 ? "fl32" : "fl64", 4);
+      // An empty, padded compression name
+      p[30] = 0;
+      p[31] = 0;
+    }
+    p += 8 + common_size;
+    std::memcpy(p, "SSND", 4);
+    put_be32(p + 4, size + 8);
+    put_be32(p + 8, 0);
+    put_be32(p + 12, 0);
+  } else {
+    int encoding = format_.floating_point ?
+      (format_.bits == 32 ? 6 : 7) :
+      format_.bits/8 + 1;
+    header.resize(24);
+    uint8_t * p = header.data();
+    std::memcpy(p, ".snd", 4);
+    put_be32(p + 4, header.size());
+    put_be32(p + 8, size);
+    put_be32(p + 12, encoding);
+    put_be32(p + 16, format_.sample_rate);
+    put_be32(p + 20, format_.channels);
+  }
+
+  if (fwrite(header.data(), 1, header.size(), file_) != header.size()) {
+    throw std::runtime_error(
+        "Could not write header to file: " + filename_);
+  }
+  format_.data_offset = header.size();
+}
@@ -0,0 +1,200 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <cmath>
+#include <cstdio>
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+
+extern "C" {
+#include <libavformat/avformat.h>
+};
+
+#include "audiorw.hpp"
+#include "kernels.hpp"
+
+namespace audiorw {
+namespace internal {
+
+// The layout of the samples in an uncompressed WAV, AIFF or AU file
+struct PcmFormat {
+  enum Container {
+    Wav,
+    Aiff,
+    Au
+  };
+
+  Container container;
+  // The format FFMPEG's decoder would produce for these samples
+  AVSampleFormat sample_format;
+  // Stored bits per sample, one of 8, 16, 24, 32 or 64
+  int bits;
+  bool floating_point;
+  bool big_endian;
+  // 8 bit WAV samples are unsigned, everywhere else they are signed
+  bool is_unsigned;
+  int channels;
+  int sample_rate;
+  // Zero unless the file specifies one
+  uint64_t channel_layout;
+  // Where the samples start and how many frames there are
+  size_t data_offset;
+  size_t frames;
+
+  int block_align() const { return channels * bits/8; }
+  // The file's channel layout or the default one for its channels
+  uint64_t layout() const;
+  AVCodecID codec_id() const;
+  const char * format_name() const;
+};
+
+// Parse the header of a WAV, AIFF or AU file. Returns false if the
+// file is something else or isn't plain PCM, e.g. compressed or
+// mu-law, so it has to go through FFMPEG instead.
+bool parse_pcm_header(const uint8_t * data, size_t size, PcmFormat & format);
+
+// Whether reading with the options needs resampling or remixing
+bool needs_conversion(const PcmFormat & format, const ReadOptions & options);
+
+// Whether the stored samples can be used in place
+// as packed samples of the given format
+bool pcm_viewable(const PcmFormat & format, AVSampleFormat sample_format);
+
+// Choose the container from a file extension, returns false if
+// the extension is not one the native writer handles
+bool pcm_container(const std::string & filename, PcmFormat::Container & container);
+
+// The format of a new file, integer samples may have 16, 24
+// or 32 bits and floating point samples 32 or 64
+PcmFormat pcm_format(
+    PcmFormat::Container container,
+    int sample_rate,
+    int channels,
+    int bits=16,
+    bool floating_point=false);
+
+// A read only memory mapping of a whole file
+class MappedFile {
+  public:
+    MappedFile();
+    ~MappedFile();
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile & operator=(const MappedFile &) = delete;
+
+    // Returns false if the file can't be mapped. Sequential
+    // mappings are read ahead more aggressively.
+    bool open(const std::string & filename, bool sequential=true);
+
+    const uint8_t * data() const { return data_; }
+    size_t size() const { return size_; }
+
+  private:
+    const uint8_t * data_;
+    size_t size_;
+};
+
+// A mapped PCM file, or PCM in memory, and its format
+struct PcmFile {
+  MappedFile file;
+  const uint8_t * data = NULL;
+  size_t size = 0;
+  PcmFormat format;
+
+  // Returns false if the file isn't plain PCM or can't be mapped
+  bool open(const std::string & filename, bool sequential=true);
+  // Returns false if the memory isn't plain PCM, which must outlive this
+  bool open(const uint8_t * data, size_t size);
+
+  const uint8_t * frame(size_t frame) const {
+    return data + format.data_offset + frame * format.block_align();
+  }
+};
+
+// Convert frames of stored samples to packed or planar
+// int16_t, int32_t, float or double output
+void decode_pcm(
+    const PcmFormat & format,
+    const uint8_t * source,
+    size_t frames,
+    uint8_t * const * output,
+    AVSampleFormat output_format);
+
+// Writes plain PCM with large buffered writes
+class PcmWriter {
+  public:
+    PcmWriter();
+    ~PcmWriter();
+
+    PcmWriter(const PcmWriter &) = delete;
+    PcmWriter & operator=(const PcmWriter &) = delete;
+
+    // Open the file and write a header that is completed by close,
+    // dithering float samples that are stored as integers
+    void open(const std::string & filename, const PcmFormat & format, bool dither=false);
+
+    // Convert frames of packed or planar int16_t,
+    // int32_t, float or double input and store them
+    void write(
+        const uint8_t * const * input,
+        AVSampleFormat input_format,
+        size_t frames);
+
+    // Flush the samples and fill in the header's sizes
+    void close();
+
+    const PcmFormat & format() const { return format_; }
+
+  private:
+    void write_header();
+    void flush();
+
+    std::string filename_;
+    PcmFormat format_;
+    FILE * file_;
+    std::vector<uint8_t> buffer_;
+    size_t buffered_;
+    // Set if float samples are dithered, with room to stage
+    // them when they can't be quantized straight into the buffer
+    std::unique_ptr<Dither> dither_;
+    std::vector<uint8_t> quantized_;
+};
+
+// Sample conversions matching libswresample's
+inline void convert_sample(uint8_t x, int16_t & y) { y = (x - 0x80) * (1 << 8); }
+inline void convert_sample(uint8_t x, int32_t & y) { y = (x - 0x80) * (1 << 24); }
+inline void convert_sample(uint8_t x, float & y) { y = (x - 0x80) * (1.0f / (1 << 7)); }
+inline void convert_sample(uint8_t x, double & y) { y = (x - 0x80) * (1.0 / (1 << 7)); }
+
+inline void convert_sample(int16_t x, int16_t & y) { y = x; }
+inline void convert_sample(int16_t x, int32_t & y) { y = int32_t(x) * (1 << 16); }
+inline void convert_sample(int16_t x, float & y) { y = x * (1.0f / (1 << 15)); }
+inline void convert_sample(int16_t x, double & y) { y = x * (1.0 / (1 << 15)); }
+
+inline void convert_sample(int32_t x, int16_t & y) { y = x >> 16; }
+inline void convert_sample(int32_t x, int32_t & y) { y = x; }
+inline void convert_sample(int32_t x, float & y) { y = x * (1.0f / (1U << 31)); }
+inline void convert_sample(int32_t x, double & y) { y = x * (1.0 / (1U << 31)); }
+
+inline void convert_sample(float x, int16_t & y) {
+  y = std::max(std::min(std::lrint(x * (1 << 15)), 32767L), -32768L);
+}
+inline void convert_sample(float x, int32_t & y) {
+  y = std::max(std::min(std::llrint(x * (1U << 31)), 2147483647LL), -2147483648LL);
+}
+inline void convert_sample(float x, float & y) { y = x; }
+inline void convert_sample(float x, double & y) { y = x; }
+
+inline void convert_sample(double x, int16_t & y) {
+  y = std::max(std::min(std::lrint(x * (1 << 15)), 32767L), -32768L);
+}
+inline void convert_sample(double x, int32_t & y) {
+  y = std::max(std::min(std::llrint(x * (1U << 31)), 2147483647LL), -2147483648LL);
+}
+inline void convert_sample(double x, float & y) { y = x; }
+inline void convert_sample(double x, double & y) { y = x; }
+
+}
+}
@@ -0,0 +1,351 @@
+#include <vector>
+#include <string>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <algorithm>
+#include <stdexcept>
+#include <ciso646>
+
+#include <sys/stat.h>
+
+#include "audiorw.hpp"
+
+using namespace audiorw;
+
+// Identifies sidecar files and their version
+static const char PEAK_MAGIC[8] = {'A', 'R', 'W', 'P', 'E', 'A', 'K', '1'};
+// Each entry holds a min, max and RMS per channel
+static const int PEAK_VALUES = 3;
+
+// Scale samples to 16 bits, rounding outwards so peaks are never understated
+static int16_t quantize(double value, bool round_up) {
+  value = std::max(-1., std::min(1., value)) * 32767;
+  return round_up ? std::ceil(value) : std::floor(value);
+}
+
+static bool file_status(const std::string & filename, int64_t & size, int64_t & modified) {
+  struct stat status;
+  if (stat(filename.c_str(), &status) != 0) return false;
+  size = status.st_size;
+  modified = status.st_mtime;
+  return true;
+}
+
+// Little endian integers for the sidecar file
+static void put(std::vector<uint8_t> & data, uint64_t value, int bytes) {
+  for (int i = 0; i < bytes; i++) {
+    data.push_back(value >> (8 * i));
+  }
+}
+
+static uint64_t get(const std::vector<uint8_t> & data, size_t & offset, int bytes, const std::string & filename) {
+  if (data.size() - offset < size_t(bytes)) {
+    throw std::runtime_error(
+        "Truncated peak index file: " + filename);
+  }
+  uint64_t value = 0;
+  for (int i = 0; i < bytes; i++) {
+    value |= uint64_t(data[offset++]) << (8 * i);
+  }
+  return value;
+}
+
+PeakIndex::PeakIndex() :
+  sample_rate_(0),
+  channels_(0),
+  frames_(0),
+  file_size_(-1),
+  modified_(-1) {
+}
+
+PeakIndex::PeakIndex(const std::string & filename, const PeakOptions & options) :
+  PeakIndex() {
+  options_ = options;
+  if (options_.block_size <= 0 or options_.level_factor < 2 or options_.seek_interval <= 0) {
+    throw std::invalid_argument(
+        "Invalid peak index options for file: " + filename);
+  }
+  file_status(filename, file_size_, modified_);
+
+  // Decode at the file's own rate and channels, noting where packets start
+  Reader reader(filename);
+  reader.index_builder_ = this;
+  sample_rate_ = reader.sample_rate();
+  channels_ = reader.channels();
+
+  // Summarize each block of the finest level as it is decoded
+  std::vector<int16_t> finest;
+  std::vector<double> min(channels_), max(channels_), squares(channels_);
+  int64_t count = 0;
+  auto finish_block = [&]() {
+    for (int channel = 0; channel < channels_; channel++) {
+      finest.push_back(quantize(min[channel], false));
+      finest.push_back(quantize(max[channel], true));
+      finest.push_back(quantize(std::sqrt(squares[channel]/count), true));
+      min[channel] = max[channel] = squares[channel] = 0;
+    }
+    count = 0;
+  };
+  std::vector<float> block(READ_BLOCK_SIZE * channels_);
+  while (size_t read = reader.read_block(block.data(), READ_BLOCK_SIZE)) {
+    for (size_t frame = 0; frame < read; frame++) {
+      const float * samples = block.data() + frame * channels_;
+      for (int channel = 0; channel < channels_; channel++) {
+        double sample = samples[channel];
+        if (count == 0 or sample < min[channel]) min[channel] = sample;
+        if (count == 0 or sample > max[channel]) max[channel] = sample;
+        squares[channel] += sample * sample;
+      }
+      if (++count == options_.block_size) finish_block();
+    }
+    frames_ += read;
+  }
+  if (count > 0) finish_block();
+  levels_.push_back(std::move(finest));
+
+  // Each coarser level combines groups of entries from the one below
+  size_t entry_size = PEAK_VALUES * channels_;
+  while (levels_.back().size() > entry_size) {
+    size_t below = levels_.size() - 1;
+    int64_t entries = levels_[below].size()/entry_size;
+    std::vector<int16_t> level;
+    for (int64_t first = 0; first < entries; first += options_.level_factor) {
+      int64_t last = std::min(first + options_.level_factor, entries);
+      for (int channel = 0; channel < channels_; channel++) {
+        int16_t min_value = 32767, max_value = -32767;
+        double energy = 0, total = 0;
+        for (int64_t entry = first; entry < last; entry++) {
+          const int16_t * values = &levels_[below][entry * entry_size + channel * PEAK_VALUES];
+          min_value = std::min(min_value, values[0]);
+          max_value = std::max(max_value, values[1]);
+          double rms = values[2]/32767.;
+          double length = entry_frames(below, entry);
+          energy += rms * rms * length;
+          total += length;
+        }
+        level.push_back(min_value);
+        level.push_back(max_value);
+        level.push_back(quantize(std::sqrt(energy/total), true));
+      }
+    }
+    levels_.push_back(std::move(level));
+  }
+}
+
+void PeakIndex::add_seek_point(int64_t byte_position, int64_t frame) {
+  // Only the first frame of each packet marks where it starts
+  if (byte_position < 0) return;
+  if (!seek_points_.empty()) {
+    const SeekPoint & last = seek_points_.back();
+    if (byte_position <= last.byte_position) return;
+    if (frame - last.frame < options_.seek_interval) return;
+  }
+  seek_points_.push_back({byte_position, frame});
+}
+
+const PeakIndex::SeekPoint * PeakIndex::seek_point(int64_t frame) const {
+  auto point = std::upper_bound(
+      seek_points_.begin(), seek_points_.end(), frame,
+      [](int64_t target, const SeekPoint & point) { return target < point.frame; });
+  if (point == seek_points_.begin()) return NULL;
+  --point;
+  // The first packet carries the encoder delay, so it is only
+  // decoded as it is from the start of the file
+  if (point -> frame <= 0) return NULL;
+  return &*point;
+}
+
+int64_t PeakIndex::entry_frames(size_t level, int64_t entry) const {
+  int64_t span = options_.block_size;
+  for (size_t i = 0; i < level; i++) span *= options_.level_factor;
+  return std::max(std::min(span, frames_ - entry * span), int64_t(0));
+}
+
+Peak PeakIndex::entry_peak(size_t level, int64_t entry, int channel) const {
+  const int16_t * values = &levels_[level][(entry * channels_ + channel) * PEAK_VALUES];
+  Peak peak;
+  peak.min = values[0]/32767.f;
+  peak.max = values[1]/32767.f;
+  peak.rms = values[2]/32767.f;
+  return peak;
+}
+
+std::vector<std::vector<Peak>> PeakIndex::peaks(
+    int64_t start_frame,
+    int64_t end_frame,
+    size_t points) const {
+  std::vector<std::vector<Peak>> peaks(channels_, std::vector<Peak>(points));
+  start_frame = std::max(start_frame, int64_t(0));
+  end_frame = std::min(end_frame, frames_);
+  if (points == 0 or end_frame <= start_frame or levels_.empty()) return peaks;
+
+  // Use the coarsest level whose entries fit within a point
+  double width = double(end_frame - start_frame)/points;
+  size_t level = 0;
+  int64_t span = options_.block_size;
+  while (level + 1 < levels_.size() and span * options_.level_factor <= width) {
+    span *= options_.level_factor;
+    level++;
+  }
+  int64_t entries = levels_[level].size()/(PEAK_VALUES * channels_);
+
+  for (size_t point = 0; point < points; point++) {
+    // The entries overlapping the point
+    int64_t start = start_frame + point * width;
+    int64_t end = start_frame + (point + 1) * width;
+    int64_t first = start/span;
+    int64_t last = std::min(std::max(first + 1, (end + span - 1)/span), entries);
+
+    for (int channel = 0; channel < channels_; channel++) {
+      Peak & peak = peaks[channel][point];
+      double energy = 0, total = 0;
+      for (int64_t entry = first; entry < last; entry++) {
+        Peak summary = entry_peak(level, entry, channel);
+        if (entry == first or summary.min < peak.min) peak.min = summary.min;
+        if (entry == first or summary.max > peak.max) peak.max = summary.max;
+        double length = entry_frames(level, entry);
+        energy += summary.rms * summary.rms * length;
+        total += length;
+      }
+      if (total > 0) peak.rms = std::sqrt(energy/total);
+    }
+  }
+  return peaks;
+}
+
+double PeakIndex::sample_rate() const {
+  return sample_rate_;
+}
+
+int PeakIndex::channels() const {
+  return channels_;
+}
+
+int64_t PeakIndex::frames() const {
+  return frames_;
+}
+
+void PeakIndex::save(const std::string & filename) const {
+  std::vector<uint8_t> data(PEAK_MAGIC, PEAK_MAGIC + sizeof(PEAK_MAGIC));
+  uint64_t rate;
+  std::memcpy(&rate, &sample_rate_, sizeof(rate));
+  put(data, rate, 8);
+  put(data, channels_, 4);
+  put(data, frames_, 8);
+  put(data, file_size_, 8);
+  put(data, modified_, 8);
+  put(data, options_.block_size, 4);
+  put(data, options_.level_factor, 4);
+  put(data, options_.seek_interval, 8);
+
+  // Each level's entry count and entries, then the seek table
+  put(data, levels_.size(), 4);
+  for (const std::vector<int16_t> & level : levels_) {
+    put(data, level.size()/(PEAK_VALUES * channels_), 8);
+    for (int16_t value : level) {
+      put(data, uint16_t(value), 2);
+    }
+  }
+  put(data, seek_points_.size(), 8);
+  for (const SeekPoint & point : seek_points_) {
+    put(data, point.byte_position, 8);
+    put(data, point.frame, 8);
+  }
+
+  std::ofstream file(filename, std::ios::binary);
+  file.write(reinterpret_cast<const char *>(data.data()), data.size());
+  if (!file) {
+    throw std::runtime_error(
+        "Could not write peak index file: " + filename);
+  }
+}
+
+PeakIndex PeakIndex::load(const std::string & filename) {
+  std::ifstream file(filename, std::ios::binary);
+  if (!file) {
+    throw std::runtime_error(
+        "Could not open peak index file: " + filename);
+  }
+  std::vector<uint8_t> data(
+      (std::istreambuf_iterator<char>(file)),
+      std::istreambuf_iterator<char>());
+  if (data.size() < sizeof(PEAK_MAGIC) or
+      std::memcmp(data.data(), PEAK_MAGIC, sizeof(PEAK_MAGIC)) != 0) {
+    throw std::runtime_error(
+        "Not a peak index file: " + filename);
+  }
+
+  PeakIndex index;
+  size_t offset = sizeof(PEAK_MAGIC);
+  uint64_t rate = get(data, offset, 8, filename);
+  std::memcpy(&index.sample_rate_, &rate, sizeof(rate));
+  index.channels_ = get(data, offset, 4, filename);
+  index.frames_ = get(data, offset, 8, filename);
+  index.file_size_ = get(data, offset, 8, filename);
+  index.modified_ = get(data, offset, 8, filename);
+  index.options_.block_size = get(data, offset, 4, filename);
+  index.options_.level_factor = get(data, offset, 4, filename);
+  index.options_.seek_interval = get(data, offset, 8, filename);
+  if (index.channels_ <= 0 or index.options_.block_size <= 0 or index.options_.level_factor < 2) {
+    throw std::runtime_error(
+        "Invalid peak index file: " + filename);
+  }
+
+  size_t levels = get(data, offset, 4, filename);
+  for (size_t level = 0; level < levels; level++) {
+    uint64_t values = get(data, offset, 8, filename) * PEAK_VALUES * index.channels_;
+    if (values > (data.size() - offset)/2) {
+      throw std::runtime_error(
+          "Truncated peak index file: " + filename);
+    }
+    index.levels_.emplace_back(values);
+    for (int16_t & value : index.levels_.back()) {
+      value = int16_t(get(data, offset, 2, filename));
+    }
+  }
+  uint64_t points = get(data, offset, 8, filename);
+  if (points > (data.size() - offset)/16) {
+    throw std::runtime_error(
+        "Truncated peak index file: " + filename);
+  }
+  for (uint64_t point = 0; point < points; point++) {
+    int64_t byte_position = get(data, offset, 8, filename);
+    int64_t frame = get(data, offset, 8, filename);
+    index.seek_points_.push_back({byte_position, frame});
+  }
+  return index;
+}
+
+bool PeakIndex::describes(const std::string & filename) const {
+  int64_t size, modified;
+  return
+    file_size_ >= 0 and modified_ >= 0 and
+    file_status(filename, size, modified) and
+    file_size_ == size and modified_ == modified;
+}
+
+PeakIndex PeakIndex::cached(const std::string & filename, const PeakOptions & options) {
+  std::string sidecar = filename + ".peaks";
+
+  // Use the sidecar if it is of the same file with the same options
+  try {
+    PeakIndex index = load(sidecar);
+    if (index.describes(filename) and
+        index.options_.block_size == options.block_size and
+        index.options_.level_factor == options.level_factor and
+        index.options_.seek_interval == options.seek_interval) {
+      return index;
+    }
+  } catch (const std::runtime_error &) {
+  }
+
+  // Otherwise build it, the sidecar is only a cache so it may fail to save
+  PeakIndex index(filename, options);
+  try {
+    index.save(sidecar);
+  } catch (const std::runtime_error &) {
+  }
+  return index;
+}
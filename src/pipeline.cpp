@@ -0,0 +1,304 @@
+#include <vector>
+#include <string>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <stdexcept>
+#include <ciso646>
+
+extern "C" {
+#include <libavformat/avformat.h>
+};
+
+#include "audiorw.hpp"
+#include "internal.hpp"
+#include "io.hpp"
+#include "stats.hpp"
+#include "pipeline.hpp"
+
+using namespace audiorw;
+using namespace audiorw::internal;
+
+// Waits spin briefly before blocking until a queue changes
+static const int PIPELINE_SPIN_COUNT = 64;
+
+Pipeline::Pipeline(
+    AVFormatContext * format_context,
+    AVCodecContext * codec_context,
+    int stream_index,
+    const std::string & filename,
+    CallbackIO * io,
+    ReadStats & stats,
+    size_t depth) :
+  format_context_(format_context),
+  codec_context_(codec_context),
+  stream_index_(stream_index),
+  filename_(filename),
+  io_(io),
+  stats_(stats),
+  free_packets_(depth),
+  ready_packets_(depth),
+  free_frames_(depth),
+  ready_frames_(depth),
+  stop_(false),
+  running_(false),
+  sleepers_(0) {
+  demux_stats_.enabled = decode_stats_.enabled = stats_.enabled;
+  for (size_t i = 0; i < depth; i++) {
+    AVPacket * packet = av_packet_alloc();
+    if (packet) packets_.push_back(packet);
+    AVFrame * frame = av_frame_alloc();
+    if (frame) frames_.push_back(frame);
+    if (!packet or !frame) {
+      for (AVPacket * & packet : packets_) av_packet_free(&packet);
+      for (AVFrame * & frame : frames_) av_frame_free(&frame);
+      throw std::runtime_error(
+          "Could not allocate pipeline for file: " + filename_);
+    }
+  }
+  reset();
+}
+
+Pipeline::~Pipeline() {
+  stop();
+  for (AVPacket * & packet : packets_) {
+    av_packet_free(&packet);
+  }
+  for (AVFrame * & frame : frames_) {
+    av_frame_free(&frame);
+  }
+  packets_.clear();
+  frames_.clear();
+}
+
+void Pipeline::start() {
+  stop_ = false;
+  running_ = true;
+  demux_thread_ = std::thread(&Pipeline::demux, this);
+  decode_thread_ = std::thread(&Pipeline::decode, this);
+}
+
+void Pipeline::stop() {
+  if (!running_) return;
+  stop_ = true;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    changed_.notify_all();
+  }
+  demux_thread_.join();
+  decode_thread_.join();
+  running_ = false;
+  collect_stats();
+}
+
+void Pipeline::notify() {
+  // Only take the lock if a stage is asleep. The fence orders the
+  // queue change before reading the count, pairing with the one
+  // in wait, so either the sleeper sees the change or this sees it.
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (sleepers_.load(std::memory_order_relaxed) == 0) return;
+  std::lock_guard<std::mutex> lock(mutex_);
+  changed_.notify_all();
+}
+
+void Pipeline::collect_stats() {
+  for (ReadStats * stage : {&demux_stats_, &decode_stats_}) {
+    stats_.demux_time += stage -> demux_time;
+    stats_.decode_time += stage -> decode_time;
+    stats_.packets += stage -> packets;
+    stats_.bytes += stage -> bytes;
+    stats_.frames += stage -> frames;
+    stats_.allocations += stage -> allocations;
+    bool enabled = stage -> enabled;
+    *stage = ReadStats();
+    stage -> enabled = enabled;
+  }
+}
+
+void Pipeline::reset() {
+  stop();
+
+  // Everything goes back to being free
+  free_packets_.clear();
+  ready_packets_.clear();
+  free_frames_.clear();
+  ready_frames_.clear();
+  for (AVPacket * packet : packets_) {
+    av_packet_unref(packet);
+    free_packets_.push(packet);
+  }
+  for (AVFrame * frame : frames_) {
+    av_frame_unref(frame);
+    free_frames_.push(frame);
+  }
+
+  demux_packet_ = NULL;
+  demux_filled_ = false;
+  demux_ended_ = false;
+  decode_packet_ = NULL;
+  decode_frame_ = NULL;
+  decode_filled_ = false;
+  decode_ended_ = false;
+  ended_ = false;
+  demux_error_ = std::exception_ptr();
+  decode_error_ = std::exception_ptr();
+}
+
+template <typename Operation>
+bool Pipeline::wait(const Operation & operation, bool stoppable) {
+  // Spin in case the other stage is about to catch up
+  bool done = false;
+  for (int tries = 0; tries < PIPELINE_SPIN_COUNT and not done; tries++) {
+    if (stoppable and stop_.load(std::memory_order_acquire)) return false;
+    if (!(done = operation())) std::this_thread::yield();
+  }
+
+  // Otherwise sleep until a queue changes. Sleepers are counted
+  // before trying again, and changes are announced under the lock,
+  // so none can slip in between trying and waiting.
+  if (not done) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    sleepers_.fetch_add(1);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    while (!operation()) {
+      if (stoppable and stop_.load(std::memory_order_acquire)) {
+        sleepers_.fetch_sub(1);
+        return false;
+      }
+      changed_.wait(lock);
+    }
+    sleepers_.fetch_sub(1);
+  }
+  notify();
+  return true;
+}
+
+int Pipeline::receive_frame(AVFrame * frame) {
+  if (ended_) return AVERROR_EOF;
+  if (!running_) start();
+
+  AVFrame * ready;
+  wait([&]() { return ready_frames_.pop(ready); }, false);
+
+  // A frame without buffers marks the end, or an error
+  if (!ready -> buf[0]) {
+    free_frames_.push(ready);
+    ended_ = true;
+    stop();
+    if (demux_error_) std::rethrow_exception(demux_error_);
+    if (decode_error_) std::rethrow_exception(decode_error_);
+    return AVERROR_EOF;
+  }
+
+  av_frame_unref(frame);
+  av_frame_move_ref(frame, ready);
+  free_frames_.push(ready);
+  notify();
+  return 0;
+}
+
+void Pipeline::demux() {
+  while (not demux_ended_) {
+    // Take a free packet and fill it from the file
+    if (!demux_packet_ and !wait([&]() { return free_packets_.pop(demux_packet_); })) return;
+    if (!demux_filled_) {
+      try {
+        while (true) {
+          int error;
+          {
+            StageTimer timer(demux_stats_.demux_time);
+            error = av_read_frame(format_context_, demux_packet_);
+          }
+          if (error == AVERROR_EOF) {
+            demux_packet_ -> stream_index = -1;
+          } else if (error < 0) {
+            if (io_) io_ -> rethrow();
+            throw std::runtime_error(
+                "Error reading from file: " + filename_ + "\n" +
+                error_string(error));
+          } else if (demux_packet_ -> stream_index != stream_index_) {
+            // Is this the correct stream? Otherwise move on
+            av_packet_unref(demux_packet_);
+            continue;
+          }
+          break;
+        }
+      } catch (...) {
+        demux_error_ = std::current_exception();
+        av_packet_unref(demux_packet_);
+        demux_packet_ -> stream_index = -1;
+      }
+      demux_filled_ = true;
+    }
+
+    // Hand it to the decoder
+    if (!wait([&]() { return ready_packets_.push(demux_packet_); })) return;
+    demux_ended_ = demux_packet_ -> stream_index < 0;
+    demux_packet_ = NULL;
+    demux_filled_ = false;
+  }
+}
+
+void Pipeline::decode() {
+  while (true) {
+    // Hand over a decoded frame first
+    if (decode_filled_) {
+      if (!wait([&]() { return ready_frames_.push(decode_frame_); })) return;
+      decode_frame_ = NULL;
+      decode_filled_ = false;
+      if (decode_ended_) return;
+      continue;
+    }
+
+    if (!decode_frame_ and !wait([&]() { return free_frames_.pop(decode_frame_); })) return;
+    try {
+      // Receive a decoded frame from the decoder
+      int error;
+      {
+        StageTimer timer(decode_stats_.decode_time);
+        error = avcodec_receive_frame(codec_context_, decode_frame_);
+      }
+      if (error == 0) {
+        tally(decode_stats_.frames);
+        decode_filled_ = true;
+        continue;
+      } else if (error == AVERROR_EOF) {
+        decode_filled_ = true;
+        decode_ended_ = true;
+        continue;
+      } else if (error != AVERROR(EAGAIN)) {
+        throw std::runtime_error(
+            "Error receiving packet from decoder for file: " + filename_ + "\n" +
+            error_string(error));
+      }
+
+      // The decoder needs more input
+      if (!decode_packet_ and !wait([&]() { return ready_packets_.pop(decode_packet_); })) return;
+      bool end = decode_packet_ -> stream_index < 0;
+      {
+        StageTimer timer(decode_stats_.decode_time);
+        error = avcodec_send_packet(codec_context_, end ? NULL : decode_packet_);
+      }
+      if (error == AVERROR(EAGAIN)) continue;
+      if (!end) {
+        tally(decode_stats_.packets);
+        tally(decode_stats_.bytes, decode_packet_ -> size);
+      }
+      av_packet_unref(decode_packet_);
+      free_packets_.push(decode_packet_);
+      notify();
+      decode_packet_ = NULL;
+      if (error < 0 and error != AVERROR_EOF) {
+        throw std::runtime_error(
+            "Could not send packet to decoder for file: " + filename_ + "\n" +
+            error_string(error));
+      }
+    } catch (...) {
+      decode_error_ = std::current_exception();
+      av_frame_unref(decode_frame_);
+      decode_filled_ = true;
+      decode_ended_ = true;
+    }
+  }
+}
@@ -0,0 +1,154 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+
+extern "C" {
+#include <libavformat/avformat.h>
+};
+
+#include "audiorw.hpp"
+
+namespace audiorw {
+namespace internal {
+
+class CallbackIO;
+
+// A bounded lock free queue for one producer thread and one consumer thread
+template <typename T>
+class SpscQueue {
+  public:
+    explicit SpscQueue(size_t capacity) :
+      slots_(capacity + 1),
+      head_(0),
+      tail_(0) {
+    }
+
+    // Returns false if the queue is full
+    bool push(const T & value) {
+      size_t tail = tail_.load(std::memory_order_relaxed);
+      size_t next = (tail + 1) % slots_.size();
+      if (next == head_.load(std::memory_order_acquire)) return false;
+      slots_[tail] = value;
+      tail_.store(next, std::memory_order_release);
+      return true;
+    }
+
+    // Returns false if the queue is empty
+    bool pop(T & value) {
+      size_t head = head_.load(std::memory_order_relaxed);
+      if (head == tail_.load(std::memory_order_acquire)) return false;
+      value = slots_[head];
+      head_.store((head + 1) % slots_.size(), std::memory_order_release);
+      return true;
+    }
+
+    // Only safe while neither thread is using the queue
+    void clear() {
+      head_.store(0);
+      tail_.store(0);
+    }
+
+  private:
+    std::vector<T> slots_;
+    std::atomic<size_t> head_;
+    std::atomic<size_t> tail_;
+};
+
+// Reads packets on one thread and decodes them on another, handing
+// the decoded frames to the reader. Packets and frames are allocated
+// once and cycle between the stages through pairs of queues.
+class Pipeline {
+  public:
+    Pipeline(
+        AVFormatContext * format_context,
+        AVCodecContext * codec_context,
+        int stream_index,
+        const std::string & filename,
+        CallbackIO * io,
+        ReadStats & stats,
+        size_t depth);
+    ~Pipeline();
+
+    Pipeline(const Pipeline &) = delete;
+    Pipeline & operator=(const Pipeline &) = delete;
+
+    // Like avcodec_receive_frame but waits for the frame rather than
+    // returning EAGAIN. Restarts the stages if they were stopped.
+    // Errors from the stages are rethrown here.
+    int receive_frame(AVFrame * frame);
+
+    // Pause the stages so the format and codec contexts can be
+    // used directly, e.g. to seek. Nothing queued is lost.
+    void stop();
+
+    // Drop everything queued or in progress, after a seek
+    void reset();
+
+    // What the decode thread counts into, e.g. from get_buffer.
+    // Added to the reader's stats whenever the stages stop.
+    ReadStats & decode_stats() { return decode_stats_; }
+
+  private:
+    void start();
+    void demux();
+    void decode();
+    // Retry the operation until it succeeds, returns false
+    // if the stages are stopped in the meantime
+    template <typename Operation>
+    bool wait(const Operation & operation, bool stoppable=true);
+    // Wake any stage waiting on a queue, after changing one
+    void notify();
+    // Add what the stages counted to the reader's stats
+    void collect_stats();
+
+    AVFormatContext * format_context_;
+    AVCodecContext * codec_context_;
+    int stream_index_;
+    std::string filename_;
+    CallbackIO * io_;
+    ReadStats & stats_;
+    // Each stage counts on its own so the reader's
+    // stats are only written from the reader's thread
+    ReadStats demux_stats_;
+    ReadStats decode_stats_;
+
+    std::vector<AVPacket *> packets_;
+    std::vector<AVFrame *> frames_;
+    SpscQueue<AVPacket *> free_packets_;
+    SpscQueue<AVPacket *> ready_packets_;
+    SpscQueue<AVFrame *> free_frames_;
+    SpscQueue<AVFrame *> ready_frames_;
+
+    // What each stage was holding on to when it was stopped.
+    // The end of the stream is a packet with a negative stream
+    // index or a frame without any buffers.
+    AVPacket * demux_packet_;
+    bool demux_filled_;
+    bool demux_ended_;
+    AVPacket * decode_packet_;
+    AVFrame * decode_frame_;
+    bool decode_filled_;
+    bool decode_ended_;
+    bool ended_;
+    std::exception_ptr demux_error_;
+    std::exception_ptr decode_error_;
+
+    std::atomic<bool> stop_;
+    bool running_;
+    // Signalled when a queue changes while a stage is
+    // asleep waiting on it, or when the stages are stopped
+    std::mutex mutex_;
+    std::condition_variable changed_;
+    std::atomic<int> sleepers_;
+    std::thread demux_thread_;
+    std::thread decode_thread_;
+};
+
+}
+}
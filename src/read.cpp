@@ -5,6 +5,8 @@
 #include <limits>
 #include <cmath>
 #include <algorithm>
+#include <memory>
+#include <functional>
 
 extern "C" {
 #include <libavformat/avformat.h>
@@ -12,223 +14,462 @@ extern "C" {
 };
 
 #include "audiorw.hpp"
+#include "internal.hpp"
+#include "parallel.hpp"
+#include "pcm.hpp"
 
 using namespace audiorw;
+using namespace audiorw::internal;
 
-std::vector<std::vector<double>> audiorw::read(
-    const std::string & filename,
-    double & sample_rate,
-    double start_seconds,
-    double end_seconds) {
-
-  // Get a buffer for writing errors to
-  size_t errbuf_size = 200;
-  char errbuf[200];
-  
-  // Initialize variables
-  AVCodecContext * codec_context = NULL;
-  AVFormatContext * format_context = NULL;
-  SwrContext * resample_context = NULL;
-  AVFrame * frame = NULL;
-  AVPacket packet;
-
-  // Open the file and get format information
-  int error = avformat_open_input(&format_context, filename.c_str(), NULL, 0);
-  if (error != 0) {
-    av_strerror(error, errbuf, errbuf_size);
-    throw std::invalid_argument(
-        "Could not open audio file: " + filename + "\n" +
-        "Error: " + std::string(errbuf));
+// Seek to the start of a range in seconds and return the
+// number of frames in it, which is unbounded if the end is open
+static int64_t seek_range(Reader & reader, double start_seconds, double end_seconds) {
+  // Get start and end values in samples
+  start_seconds = std::max(start_seconds, 0.);
+  int64_t start_sample = std::floor(start_seconds * reader.sample_rate());
+  int64_t end_sample = std::numeric_limits<int64_t>::max();
+  if (end_seconds >= 0) {
+    end_sample = std::floor(end_seconds * reader.sample_rate());
   }
 
-  // Get stream info
-  if ((error = avformat_find_stream_info(format_context, NULL)) < 0) {
-    cleanup(codec_context, format_context, resample_context, frame, packet);
-    av_strerror(error, errbuf, errbuf_size);
-    throw std::runtime_error(
-        "Could not get information about the stream in file: " + filename + "\n" +
-        "Error: " + std::string(errbuf));
+  // Seek to the start rather than decoding everything before it
+  if (start_sample > 0) {
+    reader.seek(start_sample);
   }
 
-  // Find an audio stream and its decoder
-  AVCodec * codec = NULL;
-  int audio_stream_index = av_find_best_stream(
-      format_context, 
-      AVMEDIA_TYPE_AUDIO, 
-      -1, -1, &codec, 0);
-  if (audio_stream_index < 0) {
-    cleanup(codec_context, format_context, resample_context, frame, packet);
-    throw std::runtime_error(
-        "Could not determine the best stream to use in the file: " + filename);
-  }
+  return std::max(end_sample - start_sample, int64_t(0));
+}
 
-  // Allocate context for decoding the codec
-  codec_context = avcodec_alloc_context3(codec);
-  if (!codec_context) {
-    cleanup(codec_context, format_context, resample_context, frame, packet);
-    throw std::runtime_error(
-        "Could not allocate a decoding context for file: " + filename);
-  }
+// Estimate the number of frames a range will decode to from the
+// duration of the file so the output can be allocated up front
+static int64_t expected_length(Reader & reader, int64_t length) {
+  int64_t duration = reader.duration();
+  if (duration < 0) return std::min(length, int64_t(READ_BLOCK_SIZE));
+  return std::max(std::min(duration - reader.tell(), length), int64_t(0));
+}
 
-  // Fill the codecContext with parameters of the codec
-  if ((error = avcodec_parameters_to_context(
-        codec_context, 
-        format_context -> streams[audio_stream_index] -> codecpar
-        )) != 0) {
-    cleanup(codec_context, format_context, resample_context, frame, packet);
-    throw std::runtime_error(
-        "Could not set codec context parameters for file: " + filename);
-  }
+// Grow a buffer that turned out to be too short
+static int64_t grown_length(int64_t current, int64_t length) {
+  return std::min(current + std::max(current/2, int64_t(READ_BLOCK_SIZE)), length);
+}
 
-  // Initialize the decoder
-  if ((error = avcodec_open2(codec_context, codec, NULL)) != 0) {
-    cleanup(codec_context, format_context, resample_context, frame, packet);
-    av_strerror(error, errbuf, errbuf_size);
-    throw std::runtime_error(
-        "Could not initialize the decoder for file: " + filename + "\n" +
-        "Error: " + std::string(errbuf));
-  }
+// Decodes into a vector per channel
+template <typename T>
+class ChannelsOutput {
+  public:
+    ChannelsOutput(std::vector<std::vector<T>> & audio) : audio_(audio) {}
 
-  // Make sure there is a channel layout
-  if (codec_context -> channel_layout == 0) {
-    codec_context -> channel_layout =
-      av_get_default_channel_layout(codec_context -> channels);
-  }
+    int64_t frames() const {
+      return audio_[0].size();
+    }
+
+    void resize(int64_t frames) {
+      for (std::vector<T> & channel : audio_) {
+        channel.resize(frames);
+      }
+    }
+
+    // Decode up to the given number of frames from the offset onwards.
+    // Safe to call from several threads on disjoint ranges.
+    size_t read(Reader & reader, int64_t offset, int64_t frames) {
+      std::vector<T *> channels(audio_.size());
+      for (size_t channel = 0; channel < audio_.size(); channel++) {
+        channels[channel] = audio_[channel].data() + offset;
+      }
+      size_t read = 0;
+      while (read < size_t(frames)) {
+        size_t count = reader.read_block(channels.data(), frames - read);
+        if (count == 0) break;
+        for (T * & channel : channels) {
+          channel += count;
+        }
+        read += count;
+      }
+      return read;
+    }
+
+  private:
+    std::vector<std::vector<T>> & audio_;
+};
+
+// Decodes into a contiguous buffer
+template <typename T>
+class BufferOutput {
+  public:
+    BufferOutput(AudioBuffer<T> & audio) : audio_(audio) {}
+
+    int64_t frames() const {
+      return audio_.frames();
+    }
+
+    void resize(int64_t frames) {
+      audio_.resize(frames);
+    }
 
-  // Fetch the sample rate
-  sample_rate = codec_context -> sample_rate;
-  if (sample_rate <= 0) {
-    cleanup(codec_context, format_context, resample_context, frame, packet);
-    throw std::runtime_error(
-        "Sample rate is " + std::to_string(sample_rate));
+    // Decode up to the given number of frames from the offset onwards.
+    // Safe to call from several threads on disjoint ranges.
+    size_t read(Reader & reader, int64_t offset, int64_t frames) {
+      AudioBuffer<T> view(
+          &audio_(0, offset),
+          audio_.channels(),
+          frames,
+          audio_.channel_stride(),
+          audio_.frame_stride());
+      size_t read = 0;
+      while (read < size_t(frames)) {
+        size_t count = reader.read_block(view, read);
+        if (count == 0) break;
+        read += count;
+      }
+      return read;
+    }
+
+  private:
+    AudioBuffer<T> & audio_;
+};
+
+// Whether the file can be split into segments that are decoded
+// independently, which needs exact lengths and cheap, exact seeking
+static bool segmentable(const Reader & reader, const ReadOptions & options) {
+  // Resampling can't be stitched back together sample accurately
+  if (options.sample_rate > 0) return false;
+
+  AVCodecID codec_id = reader.codec_id();
+  bool pcm = codec_id >= AV_CODEC_ID_PCM_S16LE and codec_id < AV_CODEC_ID_ADPCM_IMA_QT;
+  return pcm or codec_id == AV_CODEC_ID_FLAC or reader.format_name() == "ogg";
+}
+
+// Opens another reader of the same file or memory
+typedef std::function<std::unique_ptr<Reader>()> ReaderFactory;
+
+// Decode the first frames of a range in parallel segments, each with
+// its own reader, returning how many contiguous frames were decoded
+template <typename Output>
+static int64_t read_segments(
+    const ReaderFactory & open_reader,
+    const ReadOptions & options,
+    int64_t start_sample,
+    int64_t frames,
+    Output & output) {
+  int segments = worker_count(options.threads, frames/PARALLEL_SEGMENT_SIZE);
+  std::vector<int64_t> read(segments);
+
+  parallel_for(segments, segments, [&](size_t segment) {
+    int64_t begin = frames * segment / segments;
+    int64_t end = frames * (segment + 1) / segments;
+
+    std::unique_ptr<Reader> reader = open_reader();
+    if (start_sample + begin > 0) {
+      reader -> seek(start_sample + begin);
+    }
+    read[segment] = output.read(*reader, begin, end - begin);
+  });
+
+  // If the duration was an overestimate the
+  // audio is only contiguous up to the first gap
+  int64_t sample = 0;
+  for (int segment = 0; segment < segments; segment++) {
+    sample += read[segment];
+    if (sample < frames * (segment + 1) / segments) break;
   }
+  return sample;
+}
 
-  // Initialize a resampler
-  resample_context = swr_alloc_set_opts(
-      NULL,
-      // Output
-      codec_context -> channel_layout,
-      AV_SAMPLE_FMT_DBL,
-      sample_rate,
-      // Input
-      codec_context -> channel_layout,
-      codec_context -> sample_fmt,
-      sample_rate,
-      0, NULL);
-  if (!resample_context) {
-    cleanup(codec_context, format_context, resample_context, frame, packet);
-    throw std::runtime_error(
-        "Could not allocate resample context for file: " + filename);
+// Decode a range into the output, which has already been sized to the
+// expected length, and trim it to what was read. Without a factory
+// the range is decoded on this thread.
+template <typename Output>
+static void read_range(
+    Reader & reader,
+    const ReaderFactory & open_reader,
+    const ReadOptions & options,
+    int64_t length,
+    Output & output) {
+  int64_t sample = 0;
+
+  // Split long files into segments that are decoded in parallel
+  if (open_reader and
+      options.threads != 1 and
+      output.frames() >= 2 * PARALLEL_SEGMENT_SIZE and
+      segmentable(reader, options)) {
+    int64_t start_sample = reader.tell();
+    sample = read_segments(open_reader, options, start_sample, output.frames(), output);
+    if (sample < output.frames()) {
+      length = sample;
+    } else if (sample < length) {
+      // Carry on past the expected end on this thread
+      reader.seek(start_sample + sample);
+    }
   }
 
-  // Open the resampler context with the specified parameters
-  if ((error = swr_init(resample_context)) < 0) {
-    cleanup(codec_context, format_context, resample_context, frame, packet);
-    throw std::runtime_error(
-        "Could not open resample context for file: " + filename);
+  // Read until either nothing is left
+  // or we reach desired end of sample
+  while (sample < length) {
+    // If the duration was an underestimate, make room for more
+    if (sample == output.frames()) {
+      output.resize(grown_length(output.frames(), length));
+    }
+
+    // Decode directly into the output
+    size_t read = output.read(reader, sample, output.frames() - sample);
+    if (read == 0) break;
+    sample += read;
   }
 
-  // Initialize the input frame
-  if (!(frame = av_frame_alloc())) {
-    cleanup(codec_context, format_context, resample_context, frame, packet);
-    throw std::runtime_error(
-        "Could not allocate audio frame for file: " + filename);
+  // Trim any excess
+  if (sample < output.frames()) {
+    output.resize(sample);
   }
+}
 
-  // prepare a packet
-  av_init_packet(&packet);
-  packet.data = NULL;
-  packet.size = 0;
+// Read a range from an open reader into a vector per channel
+template <typename T>
+static std::vector<std::vector<T>> read_channels(
+    Reader & reader,
+    const ReaderFactory & open_reader,
+    double & sample_rate,
+    double start_seconds,
+    double end_seconds,
+    const ReadOptions & options) {
+  sample_rate = reader.sample_rate();
+  int64_t length = seek_range(reader, start_seconds, end_seconds);
 
-  // Get start and end values in samples
-  start_seconds = std::max(start_seconds, 0.);
-  double duration = (format_context -> duration)/(double)AV_TIME_BASE;
-  if (end_seconds < 0) {
-    end_seconds = duration;
-  } else {
-    end_seconds = std::min(end_seconds, duration);
-  }
-  double start_sample = std::floor(start_seconds * sample_rate);
-  double end_sample   = std::floor(end_seconds   * sample_rate);
+  // Size the output up front so the decoder can
+  // write straight into the channels
+  std::vector<std::vector<T>> audio(
+      reader.channels(),
+      std::vector<T>(expected_length(reader, length)));
 
-  // Allocate the output vector
-  std::vector<std::vector<double>> audio(codec_context -> channels);
+  ChannelsOutput<T> output(audio);
+  read_range(reader, open_reader, options, length, output);
 
-  // Read the file until either nothing is left
-  // or we reach desired end of sample
-  int sample = 0;
-  while (sample < end_sample) {
-    // Read from the frame
-    error = av_read_frame(format_context, &packet);
-    if (error == AVERROR_EOF) {
-      break;
-    } else if (error < 0) {
-      cleanup(codec_context, format_context, resample_context, frame, packet);
-      av_strerror(error, errbuf, errbuf_size);
-      throw std::runtime_error(
-          "Error reading from file: " + filename + "\n" +
-          "Error: " + std::string(errbuf));
-    }
+  return audio;
+}
 
-    // Is this the correct stream?
-    if (packet.stream_index != audio_stream_index) {
-      // Otherwise move on
-      continue;
-    }
+// Read a range from an open reader into a buffer
+template <typename T>
+static AudioBuffer<T> read_into_buffer(
+    Reader & reader,
+    const ReaderFactory & open_reader,
+    double & sample_rate,
+    double start_seconds,
+    double end_seconds,
+    Layout layout,
+    const ReadOptions & options) {
+  sample_rate = reader.sample_rate();
+  int64_t length = seek_range(reader, start_seconds, end_seconds);
 
-    // Send the packet to the decoder
-    if ((error = avcodec_send_packet(codec_context, &packet)) < 0) {
-      cleanup(codec_context, format_context, resample_context, frame, packet);
-      av_strerror(error, errbuf, errbuf_size);
-      throw std::runtime_error(
-          "Could not send packet to decoder for file: " + filename + "\n" +
-          "Error: " + std::string(errbuf));
-    }
+  // Allocate the buffer up front
+  AudioBuffer<T> audio(reader.channels(), expected_length(reader, length), layout);
 
-    // Receive a decoded frame from the decoder
-    while ((error = avcodec_receive_frame(codec_context, frame)) == 0) {
-      // Send the frame to the resampler
-      double audio_data[audio.size() * frame -> nb_samples];
-      uint8_t * audio_data_ = reinterpret_cast<uint8_t *>(audio_data);
-      const uint8_t ** frame_data = const_cast<const uint8_t**>(frame -> extended_data);
-      if ((error = swr_convert(resample_context,
-                               &audio_data_, frame -> nb_samples,
-                               frame_data  , frame -> nb_samples)) < 0) {
-        cleanup(codec_context, format_context, resample_context, frame, packet);
-        av_strerror(error, errbuf, errbuf_size);
-        throw std::runtime_error(
-            "Could not resample frame for file: " + filename + "\n" +
-            "Error: " + std::string(errbuf));
-      }
+  BufferOutput<T> output(audio);
+  read_range(reader, open_reader, options, length, output);
 
-      // Update the frame
-      for (int s = 0; s < frame -> nb_samples; s++) {
-        int index = sample + s - start_sample;
-        if ((0 <= index) and (index < end_sample)) {
-          for (int channel = 0; channel < (int) audio.size(); channel++) {
-            audio[channel].push_back(audio_data[audio.size() * s + channel]);
-          }
-        }
-      }
+  return audio;
+}
 
-      // Increment the stamp
-      sample += frame -> nb_samples;
-    }
+template <typename T>
+std::vector<std::vector<T>> audiorw::read(
+    const std::string & filename,
+    double & sample_rate,
+    double start_seconds,
+    double end_seconds,
+    const ReadOptions & options) {
 
-    // Check if the decoder had any errors
-    if (error != AVERROR(EAGAIN)) {
-      cleanup(codec_context, format_context, resample_context, frame, packet);
-      av_strerror(error, errbuf, errbuf_size);
-      throw std::runtime_error(
-          "Error receiving packet from decoder for file: " + filename + "\n" +
-          "Error: " + std::string(errbuf));
+  // Open the file for decoding
+  ReaderFactory open_reader = [&]() {
+    return std::unique_ptr<Reader>(new Reader(filename, options));
+  };
+  Reader reader(filename, options);
+  return read_channels<T>(reader, open_reader, sample_rate, start_seconds, end_seconds, options);
+}
+
+template <typename T>
+std::vector<std::vector<T>> audiorw::read(
+    const uint8_t * data,
+    size_t size,
+    double & sample_rate,
+    double start_seconds,
+    double end_seconds,
+    const ReadOptions & options) {
+
+  // Segments can decode the same memory
+  ReaderFactory open_reader = [&]() {
+    return std::unique_ptr<Reader>(new Reader(data, size, options));
+  };
+  Reader reader(data, size, options);
+  return read_channels<T>(reader, open_reader, sample_rate, start_seconds, end_seconds, options);
+}
+
+template <typename T>
+std::vector<std::vector<T>> audiorw::read(
+    const ReadCallbacks & callbacks,
+    double & sample_rate,
+    double start_seconds,
+    double end_seconds,
+    const ReadOptions & options) {
+
+  // Callbacks can only be read from once
+  Reader reader(callbacks, options);
+  return read_channels<T>(reader, ReaderFactory(), sample_rate, start_seconds, end_seconds, options);
+}
+
+template <typename T>
+AudioBuffer<T> audiorw::read_buffer(
+    const std::string & filename,
+    double & sample_rate,
+    double start_seconds,
+    double end_seconds,
+    Layout layout,
+    const ReadOptions & options) {
+  ReaderFactory open_reader = [&]() {
+    return std::unique_ptr<Reader>(new Reader(filename, options));
+  };
+  Reader reader(filename, options);
+  return read_into_buffer<T>(reader, open_reader, sample_rate, start_seconds, end_seconds, layout, options);
+}
+
+template <typename T>
+AudioBuffer<T> audiorw::read_buffer(
+    const uint8_t * data,
+    size_t size,
+    double & sample_rate,
+    double start_seconds,
+    double end_seconds,
+    Layout layout,
+    const ReadOptions & options) {
+  ReaderFactory open_reader = [&]() {
+    return std::unique_ptr<Reader>(new Reader(data, size, options));
+  };
+  Reader reader(data, size, options);
+  return read_into_buffer<T>(reader, open_reader, sample_rate, start_seconds, end_seconds, layout, options);
+}
+
+template <typename T>
+AudioBuffer<T> audiorw::read_buffer(
+    const ReadCallbacks & callbacks,
+    double & sample_rate,
+    double start_seconds,
+    double end_seconds,
+    Layout layout,
+    const ReadOptions & options) {
+  Reader reader(callbacks, options);
+  return read_into_buffer<T>(reader, ReaderFactory(), sample_rate, start_seconds, end_seconds, layout, options);
+}
+
+template <typename T>
+AudioView<T> audiorw::read_view(
+    const std::string & filename,
+    double & sample_rate,
+    double start_seconds,
+    double end_seconds,
+    const ReadOptions & options) {
+
+  // Map the file if its samples can be used as they are
+  if (options.native_pcm) {
+    std::shared_ptr<PcmFile> pcm(new PcmFile());
+    if (pcm -> open(filename, false) and
+        not needs_conversion(pcm -> format, options) and
+        pcm_viewable(pcm -> format, SampleFormat<T>::packed)) {
+      const PcmFormat & format = pcm -> format;
+      sample_rate = format.sample_rate;
+
+      // Clip the range to the file
+      int64_t frames = format.frames;
+      int64_t start_sample = std::floor(std::max(start_seconds, 0.) * sample_rate);
+      int64_t end_sample = frames;
+      if (end_seconds >= 0) {
+        end_sample = std::floor(end_seconds * sample_rate);
+      }
+      start_sample = std::min(start_sample, frames);
+      end_sample = std::max(std::min(end_sample, frames), start_sample);
+
+      const T * data = reinterpret_cast<const T *>(pcm -> frame(start_sample));
+      return AudioView<T>(
+          data, format.channels, end_sample - start_sample,
+          1, format.channels, pcm, true);
     }
   }
 
-  // Cleanup
-  cleanup(codec_context, format_context, resample_context, frame, packet);
+  // Otherwise decode it
+  return AudioView<T>(read_buffer<T>(
+        filename, sample_rate, start_seconds, end_seconds, Layout::Planar, options));
+}
 
-  return audio;
+template std::vector<std::vector<int16_t>> audiorw::read<int16_t>(
+    const std::string &, double &, double, double, const ReadOptions &);
+template std::vector<std::vector<int32_t>> audiorw::read<int32_t>(
+    const std::string &, double &, double, double, const ReadOptions &);
+template std::vector<std::vector<float>> audiorw::read<float>(
+    const std::string &, double &, double, double, const ReadOptions &);
+template std::vector<std::vector<double>> audiorw::read<double>(
+    const std::string &, double &, double, double, const ReadOptions &);
+
+template AudioBuffer<int16_t> audiorw::read_buffer<int16_t>(
+    const std::string &, double &, double, double, Layout, const ReadOptions &);
+template AudioBuffer<int32_t> audiorw::read_buffer<int32_t>(
+    const std::string &, double &, double, double, Layout, const ReadOptions &);
+template AudioBuffer<float> audiorw::read_buffer<float>(
+    const std::string &, double &, double, double, Layout, const ReadOptions &);
+template AudioBuffer<double> audiorw::read_buffer<double>(
+    const std::string &, double &, double, double, Layout, const ReadOptions &);
+
+template std::vector<std::vector<int16_t>> audiorw::read<int16_t>(
+    const uint8_t *, size_t, double &, double, double, const ReadOptions &);
+template std::vector<std::vector<int32_t>> audiorw::read<int32_t>(
+    const uint8_t *, size_t, double &, double, double, const ReadOptions &);
+template std::vector<std::vector<float>> audiorw::read<float>(
+    const uint8_t *, size_t, double &, double, double, const ReadOptions &);
+template std::vector<std::vector<double>> audiorw::read<double>(
+    const uint8_t *, size_t, double &, double, double, const ReadOptions &);
+
+template std::vector<std::vector<int16_t>> audiorw::read<int16_t>(
+    const ReadCallbacks &, double &, double, double, const ReadOptions &);
+template std::vector<std::vector<int32_t>> audiorw::read<int32_t>(
+    const ReadCallbacks &, double &, double, double, const ReadOptions &);
+template std::vector<std::vector<float>> audiorw::read<float>(
+    const ReadCallbacks &, double &, double, double, const ReadOptions &);
+template std::vector<std::vector<double>> audiorw::read<double>(
+    const ReadCallbacks &, double &, double, double, const ReadOptions &);
+
+template AudioBuffer<int16_t> audiorw::read_buffer<int16_t>(
+    const uint8_t *, size_t, double &, double, double, Layout, const ReadOptions &);
+template AudioBuffer<int32_t> audiorw::read_buffer<int32_t>(
+    const uint8_t *, size_t, double &, double, double, Layout, const ReadOptions &);
+template AudioBuffer<float> audiorw::read_buffer<float>(
+    const uint8_t *, size_t, double &, double, double, Layout, const ReadOptions &);
+template AudioBuffer<double> audiorw::read_buffer<double>(
+    const uint8_t *, size_t, double &, double, double, Layout, const ReadOptions &);
+
+template AudioBuffer<int16_t> audiorw::read_buffer<int16_t>(
+    const ReadCallbacks &, double &, double, double, Layout, const ReadOptions &);
+template AudioBuffer<int32_t> audiorw::read_buffer<int32_t>(
+    const ReadCallbacks &, double &, double, double, Layout, const ReadOptions &);
+template AudioBuffer<float> audiorw::read_buffer<float>(
+    const ReadCallbacks &, double &, double, double, Layout, const ReadOptions &);
+template AudioBuffer<double> audiorw::read_buffer<double>(
+    const ReadCallbacks &, double &, double, double, Layout, const ReadOptions &);
+
+template AudioView<int16_t> audiorw::read_view<int16_t>(
+    const std::string &, double &, double, double, const ReadOptions &);
+template AudioView<int32_t> audiorw::read_view<int32_t>(
+    const std::string &, double &, double, double, const ReadOptions &);
+template AudioView<float> audiorw::read_view<float>(
+    const std::string &, double &, double, double, const ReadOptions &);
+template AudioView<double> audiorw::read_view<double>(
+    const std::string &, double &, double, double, const ReadOptions &);
+
+int64_t audiorw::seek_preroll(const AVCodecParameters * codecpar) {
+  // Lossless codecs decode each frame independently
+  const AVCodecDescriptor * descriptor = avcodec_descriptor_get(codecpar -> codec_id);
+  if (descriptor and not (descriptor -> props & AV_CODEC_PROP_LOSSY)) {
+    return 0;
+  }
+
+  // Lossy codecs need the frames before the target to fill
+  // bit reservoirs (mp3) and overlapping windows (aac, vorbis)
+  int64_t frame_size = std::max(codecpar -> frame_size, SEEK_PREROLL_FRAME_SIZE);
+  return std::max(int64_t(codecpar -> seek_preroll), 2 * frame_size);
 }
 
 void audiorw::cleanup(
@@ -0,0 +1,750 @@
+#include <vector>
+#include <string>
+#include <stdexcept>
+#include <ciso646>
+#include <algorithm>
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libswresample/swresample.h>
+#include <libavutil/opt.h>
+};
+
+#include "audiorw.hpp"
+#include "internal.hpp"
+#include "pcm.hpp"
+#include "io.hpp"
+#include "cache.hpp"
+#include "stats.hpp"
+#include "pipeline.hpp"
+#include "frames.hpp"
+
+using namespace audiorw;
+using namespace audiorw::internal;
+
+// What a resampler from the decoder to the output is cached by
+static ResamplerKey resampler_key(
+    const AVCodecContext * codec_context,
+    AVSampleFormat format,
+    const ReadOptions & options,
+    uint64_t output_channel_layout,
+    int output_sample_rate) {
+  ResamplerKey key = {
+    codec_context -> channel_layout,
+    codec_context -> sample_fmt,
+    codec_context -> sample_rate,
+    output_channel_layout,
+    format,
+    output_sample_rate,
+    options.quality
+  };
+  return key;
+}
+
+// Every MPEG audio packet decodes to a whole frame even straight after a
+// seek, but FFMPEG can only estimate where frames are in VBR files
+static bool indexed_seeking(AVCodecID codec_id) {
+  return
+    codec_id == AV_CODEC_ID_MP3 or
+    codec_id == AV_CODEC_ID_MP2 or
+    codec_id == AV_CODEC_ID_MP1;
+}
+
+Reader::Reader(const ReadOptions & options) :
+  options_(options),
+  data_(NULL),
+  size_(0),
+  format_context_(NULL),
+  codec_context_(NULL),
+  resample_context_(NULL),
+  frame_(NULL),
+  packet_(NULL),
+  stream_(NULL),
+  seek_index_(NULL),
+  index_builder_(NULL),
+  output_format_(AV_SAMPLE_FMT_NONE),
+  output_sample_rate_(0),
+  output_channel_layout_(0),
+  output_channels_(0),
+  position_(0),
+  next_frame_position_(0),
+  seek_target_(-1),
+  frame_offset_(0),
+  draining_(false),
+  flushed_(false) {
+#ifdef AUDIORW_STATS
+  stats_.enabled = true;
+#endif
+}
+
+// Once the delegated constructor has finished the
+// destructor releases everything if opening fails
+
+Reader::Reader(const std::string & filename, const ReadOptions & options) :
+  Reader(options) {
+  filename_ = filename;
+  open();
+}
+
+Reader::Reader(const uint8_t * data, size_t size, const ReadOptions & options) :
+  Reader(options) {
+  filename_ = "memory";
+  data_ = data;
+  size_ = size;
+  open();
+}
+
+Reader::Reader(const ReadCallbacks & callbacks, const ReadOptions & options) :
+  Reader(options) {
+  filename_ = "callbacks";
+  io_.reset(new CallbackIO(callbacks, options_.io_buffer_size));
+  open();
+}
+
+Reader::~Reader() {
+  // The background stages write to the stats too
+  pipeline_.reset();
+
+  // Report the stats, the callback can't throw from here
+  if (options_.stats_callback) {
+    try {
+      options_.stats_callback(stats_);
+    } catch (...) {
+    }
+  }
+  release();
+}
+
+void Reader::open() {
+  StageTimer timer(stats_.open_time);
+
+  // Read uncompressed files straight from memory if possible
+  if (options_.native_pcm and open_pcm()) return;
+
+  // Memory is read through callbacks too
+  if (data_) {
+    io_.reset(new CallbackIO(memory_callbacks(data_, size_), options_.io_buffer_size));
+  }
+  const char * url = filename_.c_str();
+  if (io_) {
+    if (!(format_context_ = avformat_alloc_context())) {
+      throw std::runtime_error(
+          "Could not allocate input format context for: " + filename_);
+    }
+    format_context_ -> pb = io_ -> context();
+    format_context_ -> flags |= AVFMT_FLAG_CUSTOM_IO;
+    url = NULL;
+  }
+
+  // Open the file and get format information
+  int error = avformat_open_input(&format_context_, url, NULL, 0);
+  if (error != 0) {
+    if (io_) io_ -> rethrow();
+    throw std::invalid_argument(
+        "Could not open audio file: " + filename_ + "\n" +
+        error_string(error));
+  }
+
+  // Get stream info
+  if ((error = avformat_find_stream_info(format_context_, NULL)) < 0) {
+    throw std::runtime_error(
+        "Could not get information about the stream in file: " + filename_ + "\n" +
+        error_string(error));
+  }
+
+  // Find an audio stream and its decoder
+  AVCodec * codec = NULL;
+  int audio_stream_index = av_find_best_stream(
+      format_context_,
+      AVMEDIA_TYPE_AUDIO,
+      -1, -1, &codec, 0);
+  if (audio_stream_index < 0) {
+    throw std::runtime_error(
+        "Could not determine the best stream to use in the file: " + filename_);
+  }
+  stream_ = format_context_ -> streams[audio_stream_index];
+
+  // Reuse a decoder opened for a stream like this one
+  if (options_.cache) {
+    codec_context_ = options_.cache -> pool_ -> take_decoder(DecoderKey(stream_ -> codecpar));
+  }
+
+  if (!codec_context_) {
+    // Allocate context for decoding the codec
+    if (!(codec_context_ = avcodec_alloc_context3(codec))) {
+      throw std::runtime_error(
+          "Could not allocate a decoding context for file: " + filename_);
+    }
+
+    // Fill the codecContext with parameters of the codec
+    if ((error = avcodec_parameters_to_context(codec_context_, stream_ -> codecpar)) != 0) {
+      throw std::runtime_error(
+          "Could not set codec context parameters for file: " + filename_);
+    }
+
+    // Initialize the decoder
+    if ((error = avcodec_open2(codec_context_, codec, NULL)) != 0) {
+      throw std::runtime_error(
+          "Could not initialize the decoder for file: " + filename_ + "\n" +
+          error_string(error));
+    }
+  }
+
+  // Decode into pooled buffers, shared between files through the cache.
+  // Decoders that can't decode into our buffers must use their own.
+  frame_pool_ = options_.cache ?
+    options_.cache -> pool_ -> frames() :
+    std::make_shared<FramePool>();
+  if (codec_context_ -> codec -> capabilities & AV_CODEC_CAP_DR1) {
+    codec_context_ -> opaque = this;
+    codec_context_ -> get_buffer2 = &Reader::get_buffer;
+  }
+
+  // Make sure there is a channel layout
+  if (codec_context_ -> channels <= 0) {
+    throw std::runtime_error(
+        "Could not determine the number of channels in file: " + filename_);
+  }
+  if (codec_context_ -> channel_layout == 0) {
+    codec_context_ -> channel_layout =
+      av_get_default_channel_layout(codec_context_ -> channels);
+  }
+
+  // Check the sample rate
+  if (codec_context_ -> sample_rate <= 0) {
+    throw std::runtime_error(
+        "Sample rate is " + std::to_string(codec_context_ -> sample_rate));
+  }
+
+  // Choose the output rate and layout, by default they match the file
+  output_sample_rate_ = codec_context_ -> sample_rate;
+  if (options_.sample_rate > 0) {
+    output_sample_rate_ = options_.sample_rate;
+  }
+  output_channel_layout_ = codec_context_ -> channel_layout;
+  if (options_.channel_layout != 0) {
+    output_channel_layout_ = options_.channel_layout;
+  } else if (options_.channels > 0) {
+    output_channel_layout_ = av_get_default_channel_layout(options_.channels);
+  }
+  output_channels_ = av_get_channel_layout_nb_channels(output_channel_layout_);
+  if (output_channels_ <= 0) {
+    throw std::invalid_argument(
+        "Invalid output channel layout for file: " + filename_);
+  }
+
+  // Allocate the decoded frame and the packet that feeds it
+  if (!(frame_ = av_frame_alloc())) {
+    throw std::runtime_error(
+        "Could not allocate audio frame for file: " + filename_);
+  }
+  if (!(packet_ = av_packet_alloc())) {
+    throw std::runtime_error(
+        "Could not allocate packet for file: " + filename_);
+  }
+
+  // Seek with the index's table if it was built from this file as it
+  // is now. Memory and callback input can't be checked, so don't trust it.
+  const PeakIndex * index = options_.index.get();
+  if (index and !io_ and indexed_seeking(codec_context_ -> codec_id) and
+      index -> sample_rate_ == codec_context_ -> sample_rate and
+      index -> channels_ == codec_context_ -> channels and
+      index -> describes(filename_)) {
+    seek_index_ = index;
+  }
+
+  // Start demuxing and decoding in the background
+  if (options_.pipeline) {
+    pipeline_.reset(new Pipeline(
+          format_context_, codec_context_, stream_ -> index,
+          filename_, io_.get(), stats_, PIPELINE_DEPTH));
+  }
+}
+
+bool Reader::open_pcm() {
+  std::unique_ptr<PcmFile> pcm(new PcmFile());
+  if (io_) return false;
+  if (data_ ? !pcm -> open(data_, size_) : !pcm -> open(filename_)) return false;
+  const PcmFormat & format = pcm -> format;
+
+  // Anything that needs resampling or remixing goes through swr
+  if (needs_conversion(format, options_)) return false;
+
+  output_sample_rate_ = format.sample_rate;
+  output_channel_layout_ = format.layout();
+  output_channels_ = format.channels;
+  pcm_ = std::move(pcm);
+  return true;
+}
+
+void Reader::release() {
+  // Stop using the contexts in the background
+  pipeline_.reset();
+
+  // Hand contexts back to the cache rather than freeing them
+  if (options_.cache) {
+    ContextPool & pool = *options_.cache -> pool_;
+    if (resample_context_ and output_format_ != AV_SAMPLE_FMT_NONE) {
+      pool.give_resampler(resampler_key(codec_context_, output_format_, options_,
+            output_channel_layout_, output_sample_rate_), resample_context_);
+      resample_context_ = NULL;
+    }
+    // Unless the stream changed the decoder's parameters part way
+    if (codec_context_ and avcodec_is_open(codec_context_) and
+        codec_context_ -> sample_rate == stream_ -> codecpar -> sample_rate and
+        codec_context_ -> channels == stream_ -> codecpar -> channels) {
+      codec_context_ -> get_buffer2 = avcodec_default_get_buffer2;
+      codec_context_ -> opaque = NULL;
+      pool.give_decoder(DecoderKey(stream_ -> codecpar), codec_context_);
+      codec_context_ = NULL;
+    }
+  }
+
+  // Properly free any allocated space
+  pcm_.reset();
+  avcodec_free_context(&codec_context_);
+  avformat_close_input(&format_context_);
+  swr_free(&resample_context_);
+  av_frame_free(&frame_);
+  av_packet_free(&packet_);
+}
+
+size_t Reader::read_block(int16_t * audio, size_t frames) {
+  uint8_t * data = reinterpret_cast<uint8_t *>(audio);
+  return read_samples(&data, frames, SampleFormat<int16_t>::packed);
+}
+
+size_t Reader::read_block(int32_t * audio, size_t frames) {
+  uint8_t * data = reinterpret_cast<uint8_t *>(audio);
+  return read_samples(&data, frames, SampleFormat<int32_t>::packed);
+}
+
+size_t Reader::read_block(float * audio, size_t frames) {
+  uint8_t * data = reinterpret_cast<uint8_t *>(audio);
+  return read_samples(&data, frames, SampleFormat<float>::packed);
+}
+
+size_t Reader::read_block(double * audio, size_t frames) {
+  uint8_t * data = reinterpret_cast<uint8_t *>(audio);
+  return read_samples(&data, frames, SampleFormat<double>::packed);
+}
+
+size_t Reader::read_block(int16_t * const * audio, size_t frames) {
+  uint8_t * const * data = reinterpret_cast<uint8_t * const *>(audio);
+  return read_samples(data, frames, SampleFormat<int16_t>::planar);
+}
+
+size_t Reader::read_block(int32_t * const * audio, size_t frames) {
+  uint8_t * const * data = reinterpret_cast<uint8_t * const *>(audio);
+  return read_samples(data, frames, SampleFormat<int32_t>::planar);
+}
+
+size_t Reader::read_block(float * const * audio, size_t frames) {
+  uint8_t * const * data = reinterpret_cast<uint8_t * const *>(audio);
+  return read_samples(data, frames, SampleFormat<float>::planar);
+}
+
+size_t Reader::read_block(double * const * audio, size_t frames) {
+  uint8_t * const * data = reinterpret_cast<uint8_t * const *>(audio);
+  return read_samples(data, frames, SampleFormat<double>::planar);
+}
+
+template <typename T>
+size_t Reader::read_block(AudioBuffer<T> & audio, size_t offset) {
+  if (audio.channels() != channels()) {
+    throw std::invalid_argument(
+        "Can not read " + std::to_string(channels()) + " channels into a buffer with " +
+        std::to_string(audio.channels()) + " channels for file: " + filename_);
+  }
+  if (offset >= audio.frames()) return 0;
+  size_t frames = audio.frames() - offset;
+
+  if (audio.interleaved()) {
+    uint8_t * data = reinterpret_cast<uint8_t *>(&audio(0, offset));
+    return read_samples(&data, frames, SampleFormat<T>::packed);
+  } else if (audio.planar()) {
+    buffer_planes_.resize(channels());
+    for (int channel = 0; channel < channels(); channel++) {
+      buffer_planes_[channel] = reinterpret_cast<uint8_t *>(&audio(channel, offset));
+    }
+    return read_samples(buffer_planes_.data(), frames, SampleFormat<T>::planar);
+  }
+  throw std::invalid_argument(
+      "Can only read into planar or interleaved buffers for file: " + filename_);
+}
+
+template size_t Reader::read_block<int16_t>(AudioBuffer<int16_t> &, size_t);
+template size_t Reader::read_block<int32_t>(AudioBuffer<int32_t> &, size_t);
+template size_t Reader::read_block<float>(AudioBuffer<float> &, size_t);
+template size_t Reader::read_block<double>(AudioBuffer<double> &, size_t);
+
+void Reader::seek(int64_t frame) {
+  frame = std::max(frame, int64_t(0));
+  if (pcm_) {
+    position_ = frame;
+    return;
+  }
+
+  // The frame in the file's own sample rate
+  int64_t input_frame = av_rescale(frame, codec_context_ -> sample_rate, output_sample_rate_);
+
+  // Seek to a point shortly before the frame, the position
+  // is then recovered from the timestamp of the next decoded frame
+  int64_t target = std::max(input_frame - seek_preroll(stream_ -> codecpar), int64_t(0));
+  int64_t timestamp = av_rescale_q(
+      target,
+      av_make_q(1, codec_context_ -> sample_rate),
+      stream_ -> time_base);
+  if (stream_ -> start_time != AV_NOPTS_VALUE) {
+    timestamp += stream_ -> start_time;
+  }
+  // The background stages restart on the next read
+  if (pipeline_) pipeline_ -> stop();
+  // Go straight to a known packet if the index has one
+  const PeakIndex::SeekPoint * point = seek_index_ ? seek_index_ -> seek_point(target) : NULL;
+  int error = point ?
+    av_seek_frame(format_context_, stream_ -> index, point -> byte_position, AVSEEK_FLAG_BYTE) :
+    av_seek_frame(format_context_, stream_ -> index, timestamp, AVSEEK_FLAG_BACKWARD);
+  if (error < 0) {
+    // Without seeking we can still move forwards by decoding
+    int64_t frame_position = next_frame_position_ - frame_ -> nb_samples;
+    if (next_frame_position_ < 0 or input_frame < frame_position) {
+      throw std::runtime_error(
+          "Could not seek in file: " + filename_ + "\n" +
+          error_string(error));
+    }
+    if (input_frame < next_frame_position_) {
+      frame_offset_ = input_frame - frame_position;
+    } else {
+      av_frame_unref(frame_);
+      frame_offset_ = 0;
+      seek_target_ = input_frame;
+    }
+  } else {
+    avcodec_flush_buffers(codec_context_);
+    if (pipeline_) pipeline_ -> reset();
+    av_frame_unref(frame_);
+    frame_offset_ = 0;
+    // Otherwise find out where we landed from the next frame
+    next_frame_position_ = point ? point -> frame : -1;
+    seek_target_ = input_frame;
+    draining_ = false;
+  }
+
+  // Drop anything the resampler was holding on to
+  if (output_format_ != AV_SAMPLE_FMT_NONE) {
+    if ((error = swr_init(resample_context_)) < 0) {
+      output_format_ = AV_SAMPLE_FMT_NONE;
+      throw std::runtime_error(
+          "Could not reset resample context for file: " + filename_ + "\n" +
+          error_string(error));
+    }
+  }
+  flushed_ = false;
+  position_ = frame;
+}
+
+int64_t Reader::tell() const {
+  return position_;
+}
+
+double Reader::sample_rate() const {
+  return output_sample_rate_;
+}
+
+int Reader::channels() const {
+  return output_channels_;
+}
+
+int64_t Reader::duration() const {
+  if (pcm_) return pcm_ -> format.frames;
+  AVRational sample_time_base = av_make_q(1, output_sample_rate_);
+  if (stream_ -> duration != AV_NOPTS_VALUE) {
+    return av_rescale_q(stream_ -> duration, stream_ -> time_base, sample_time_base);
+  } else if (format_context_ -> duration != AV_NOPTS_VALUE) {
+    return av_rescale_q(format_context_ -> duration, av_make_q(1, AV_TIME_BASE), sample_time_base);
+  }
+  return -1;
+}
+
+AVCodecID Reader::codec_id() const {
+  if (pcm_) return pcm_ -> format.codec_id();
+  return codec_context_ -> codec_id;
+}
+
+std::string Reader::format_name() const {
+  if (pcm_) return pcm_ -> format.format_name();
+  return format_context_ -> iformat -> name;
+}
+
+size_t Reader::read_samples(uint8_t * const * audio, size_t frames, AVSampleFormat format) {
+  if (pcm_) {
+    // Convert straight out of the mapped file
+    int64_t remaining = int64_t(pcm_ -> format.frames) - position_;
+    size_t count = std::max(std::min(int64_t(frames), remaining), int64_t(0));
+    if (count > 0) {
+      StageTimer timer(stats_.convert_time);
+      decode_pcm(pcm_ -> format, pcm_ -> frame(position_), count, audio, format);
+    }
+    tally(stats_.bytes, count * pcm_ -> format.block_align());
+    tally(stats_.samples, count);
+    position_ += count;
+    return count;
+  }
+
+  // Samples already in the requested format are copied as is
+  bool convert =
+    format != codec_context_ -> sample_fmt or
+    output_sample_rate_ != codec_context_ -> sample_rate or
+    output_channel_layout_ != codec_context_ -> channel_layout;
+  if (convert) {
+    configure_output(format);
+  }
+
+  size_t read = 0;
+  while (read < frames) {
+    int wanted = frames - read;
+    offset_planes(audio, format, output_channels_, read, output_planes_);
+
+    // Fetch a new frame once the current one is used up
+    if (frame_offset_ >= frame_ -> nb_samples) {
+      if (convert) {
+        // Take what the resampler has buffered first
+        StageTimer timer(stats_.convert_time);
+        int count = swr_convert(resample_context_,
+            output_planes_.data(), wanted,
+            const_cast<const uint8_t **>(input_planes_.data()), 0);
+        if (count > 0) {
+          read += count;
+          position_ += count;
+          continue;
+        }
+      }
+      if (!decode_frame()) {
+        // Flush the delay out of the resampler at the end of the file
+        if (convert and not flushed_) {
+          StageTimer timer(stats_.convert_time);
+          int count = swr_convert(resample_context_,
+              output_planes_.data(), wanted,
+              NULL, 0);
+          if (count < 0) {
+            throw std::runtime_error(
+                "Could not flush resampler for file: " + filename_ + "\n" +
+                error_string(count));
+          }
+          read += count;
+          position_ += count;
+          if (count < wanted) flushed_ = true;
+          continue;
+        }
+        break;
+      }
+    }
+
+    // Convert as much of the frame as is needed, when
+    // resampling anything extra is buffered in swr
+    int count = frame_ -> nb_samples - frame_offset_;
+    if (convert) {
+      count = std::min<int64_t>(count,
+          av_rescale_rnd(wanted, codec_context_ -> sample_rate, output_sample_rate_, AV_ROUND_UP));
+    } else {
+      count = std::min(count, wanted);
+    }
+    offset_planes(frame_ -> extended_data, codec_context_ -> sample_fmt,
+        codec_context_ -> channels, frame_offset_, input_planes_);
+    int converted = count;
+    if (convert) {
+      StageTimer timer(stats_.convert_time);
+      converted = swr_convert(resample_context_,
+          output_planes_.data(), wanted,
+          const_cast<const uint8_t **>(input_planes_.data()), count);
+      if (converted < 0) {
+        throw std::runtime_error(
+            "Could not resample frame for file: " + filename_ + "\n" +
+            error_string(converted));
+      }
+    } else {
+      StageTimer timer(stats_.copy_time);
+      av_samples_copy(output_planes_.data(), input_planes_.data(),
+          0, 0, count, output_channels_, format);
+    }
+
+    read += converted;
+    frame_offset_ += count;
+    position_ += converted;
+  }
+
+  tally(stats_.samples, read);
+  return read;
+}
+
+bool Reader::decode_frame() {
+  while (true) {
+    // Receive a decoded frame from the decoder
+    int error;
+    if (pipeline_) {
+      // Decoded in the background, this waits rather than returning EAGAIN
+      error = pipeline_ -> receive_frame(frame_);
+    } else {
+      StageTimer timer(stats_.decode_time);
+      error = avcodec_receive_frame(codec_context_, frame_);
+      if (error == 0) tally(stats_.frames);
+    }
+    if (error == 0) {
+
+      // After a seek, find out where we landed
+      if (next_frame_position_ < 0) {
+        int64_t timestamp = frame_ -> best_effort_timestamp;
+        if (timestamp == AV_NOPTS_VALUE) {
+          throw std::runtime_error(
+              "Could not determine the position after seeking in file: " + filename_);
+        }
+        if (stream_ -> start_time != AV_NOPTS_VALUE) {
+          timestamp -= stream_ -> start_time;
+        }
+        next_frame_position_ = av_rescale_q(
+            timestamp,
+            stream_ -> time_base,
+            av_make_q(1, codec_context_ -> sample_rate));
+      }
+      int64_t frame_position = next_frame_position_;
+      next_frame_position_ += frame_ -> nb_samples;
+      frame_offset_ = 0;
+
+      // Note where packets start while building an index
+      if (index_builder_) {
+        index_builder_ -> add_seek_point(frame_ -> pkt_pos, frame_position);
+      }
+
+      // Skip what comes before the target of a seek
+      if (seek_target_ >= 0) {
+        if (next_frame_position_ <= seek_target_) {
+          continue;
+        }
+        if (frame_position < seek_target_) {
+          frame_offset_ = seek_target_ - frame_position;
+        } else if (frame_position > seek_target_) {
+          // If we landed past the target there is nothing to fill the gap with
+          position_ = av_rescale(frame_position, output_sample_rate_, codec_context_ -> sample_rate);
+        }
+        seek_target_ = -1;
+      }
+      return true;
+    } else if (error == AVERROR_EOF) {
+      return false;
+    } else if (error != AVERROR(EAGAIN)) {
+      throw std::runtime_error(
+          "Error receiving packet from decoder for file: " + filename_ + "\n" +
+          error_string(error));
+    }
+
+    // The decoder needs more input
+    if (draining_) return false;
+    {
+      StageTimer timer(stats_.demux_time);
+      error = av_read_frame(format_context_, packet_);
+    }
+    if (error == AVERROR_EOF) {
+      // Send a null packet to drain the decoder
+      draining_ = true;
+    } else if (error < 0) {
+      if (io_) io_ -> rethrow();
+      throw std::runtime_error(
+          "Error reading from file: " + filename_ + "\n" +
+          error_string(error));
+    } else if (packet_ -> stream_index != stream_ -> index) {
+      // Is this the correct stream? Otherwise move on
+      av_packet_unref(packet_);
+      continue;
+    }
+
+    // Send the packet to the decoder
+    if (!draining_) {
+      tally(stats_.packets);
+      tally(stats_.bytes, packet_ -> size);
+    }
+    {
+      StageTimer timer(stats_.decode_time);
+      error = avcodec_send_packet(codec_context_, draining_ ? NULL : packet_);
+    }
+    av_packet_unref(packet_);
+    if (error < 0) {
+      throw std::runtime_error(
+          "Could not send packet to decoder for file: " + filename_ + "\n" +
+          error_string(error));
+    }
+  }
+}
+
+const ReadStats & Reader::stats() const {
+  return stats_;
+}
+
+int Reader::get_buffer(AVCodecContext * codec_context, AVFrame * frame, int flags) {
+  // Pipelined decoding counts on its own thread
+  Reader * reader = static_cast<Reader *>(codec_context -> opaque);
+  ReadStats & stats = reader -> pipeline_ ? reader -> pipeline_ -> decode_stats() : reader -> stats_;
+  int error = reader -> frame_pool_ -> get_buffer(
+      frame, stats.enabled ? &stats.allocations : NULL);
+  if (error == AVERROR(ENOSYS)) {
+    // Too many channels for the pool
+    tally(stats.allocations);
+    return avcodec_default_get_buffer2(codec_context, frame, flags);
+  }
+  return error;
+}
+
+void Reader::configure_output(AVSampleFormat format) {
+  if (format == output_format_) return;
+
+  // Take a cached resampler already set up for this conversion
+  if (options_.cache and !resample_context_) {
+    resample_context_ = options_.cache -> pool_ -> take_resampler(
+        resampler_key(codec_context_, format, options_,
+          output_channel_layout_, output_sample_rate_));
+    if (resample_context_) {
+      input_planes_.resize(std::max(int(input_planes_.size()), codec_context_ -> channels));
+      output_format_ = format;
+      return;
+    }
+  }
+
+  // (Re)initialize the resampler for the new output format
+  resample_context_ = swr_alloc_set_opts(
+      resample_context_,
+      // Output
+      output_channel_layout_,
+      format,
+      output_sample_rate_,
+      // Input
+      codec_context_ -> channel_layout,
+      codec_context_ -> sample_fmt,
+      codec_context_ -> sample_rate,
+      0, NULL);
+  if (!resample_context_) {
+    throw std::runtime_error(
+        "Could not allocate resample context for file: " + filename_);
+  }
+  // Buffered output is pulled by converting zero input samples,
+  // which needs valid input planes to tell it apart from a flush
+  input_planes_.resize(std::max(int(input_planes_.size()), codec_context_ -> channels));
+
+  // Trade resampling speed against quality
+  if (options_.quality == ResampleQuality::Fast) {
+    av_opt_set_int(resample_context_, "filter_size", 8, 0);
+    av_opt_set_int(resample_context_, "phase_shift", 6, 0);
+  } else if (options_.quality == ResampleQuality::High) {
+    av_opt_set_int(resample_context_, "filter_size", 64, 0);
+    av_opt_set_int(resample_context_, "phase_shift", 12, 0);
+  }
+
+  // Open the resampler context with the specified parameters
+  int error;
+  if ((error = swr_init(resample_context_)) < 0) {
+    output_format_ = AV_SAMPLE_FMT_NONE;
+    throw std::runtime_error(
+        "Could not open resample context for file: " + filename_ + "\n" +
+        error_string(error));
+  }
+  output_format_ = format;
+}
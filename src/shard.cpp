@@ -0,0 +1,339 @@
+#include <vector>
+#include <string>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <stdexcept>
+#include <ciso646>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+#include <cctype>
+
+#include "audiorw.hpp"
+
+using namespace audiorw;
+using namespace audiorw::internal;
+
+static const size_t TAR_BLOCK_SIZE = 512;
+
+// Reads a file in large blocks on a background thread,
+// staying a bounded number of blocks ahead of the reader
+class audiorw::internal::ShardPrefetcher {
+  public:
+    ShardPrefetcher(const std::string & filename, size_t read_size, int read_ahead) :
+      filename_(filename),
+      file_(NULL),
+      read_size_(read_size),
+      read_ahead_(read_ahead),
+      done_(false),
+      stop_(false) {
+      if (!(file_ = fopen(filename_.c_str(), "rb"))) {
+        throw std::invalid_argument(
+            "Could not open shard: " + filename_);
+      }
+      // The reads are already large so skip stdio's buffer
+      setvbuf(file_, NULL, _IONBF, 0);
+      thread_ = std::thread(&ShardPrefetcher::run, this);
+    }
+
+    ~ShardPrefetcher() {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+      }
+      condition_.notify_all();
+      thread_.join();
+      fclose(file_);
+    }
+
+    // Swap in the next block of the file, handing the old one
+    // back to be reused. Returns false at the end of the file.
+    bool next(std::vector<uint8_t> & chunk) {
+      std::unique_lock<std::mutex> lock(mutex_);
+      if (chunk.capacity() > 0) {
+        free_.push_back(std::move(chunk));
+        chunk.clear();
+      }
+      condition_.wait(lock, [&]() { return !ready_.empty() or done_; });
+      if (ready_.empty()) {
+        if (error_) std::rethrow_exception(error_);
+        return false;
+      }
+      chunk.swap(ready_.front());
+      ready_.pop_front();
+      lock.unlock();
+      condition_.notify_all();
+      return true;
+    }
+
+  private:
+    void run() {
+      try {
+        while (true) {
+          // Wait for room in the queue and reuse a returned block
+          std::vector<uint8_t> chunk;
+          {
+            std::unique_lock<std::mutex> lock(mutex_);
+            condition_.wait(lock, [&]() {
+                return stop_ or ready_.size() < size_t(read_ahead_);
+            });
+            if (stop_) return;
+            if (!free_.empty()) {
+              chunk.swap(free_.back());
+              free_.pop_back();
+            }
+          }
+
+          chunk.resize(read_size_);
+          size_t count = fread(chunk.data(), 1, read_size_, file_);
+          if (count < read_size_ and ferror(file_)) {
+            throw std::runtime_error(
+                "Could not read from shard: " + filename_);
+          }
+          chunk.resize(count);
+
+          bool end = (count < read_size_);
+          {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (count > 0) ready_.push_back(std::move(chunk));
+            done_ = end;
+          }
+          condition_.notify_all();
+          if (end) return;
+        }
+      } catch (...) {
+        {
+          std::lock_guard<std::mutex> lock(mutex_);
+          error_ = std::current_exception();
+          done_ = true;
+        }
+        condition_.notify_all();
+      }
+    }
+
+    std::string filename_;
+    FILE * file_;
+    size_t read_size_;
+    int read_ahead_;
+    std::mutex mutex_;
+    std::condition_variable condition_;
+    std::deque<std::vector<uint8_t>> ready_;
+    std::vector<std::vector<uint8_t>> free_;
+    bool done_;
+    bool stop_;
+    std::exception_ptr error_;
+    std::thread thread_;
+};
+
+// A string field that is only null terminated if it is short enough
+static std::string tar_string(const uint8_t * field, size_t size) {
+  const char * text = reinterpret_cast<const char *>(field);
+  return std::string(text, std::find(text, text + size, '\0'));
+}
+
+// Numbers are octal text, or big endian binary if the top bit is set
+static uint64_t tar_number(const uint8_t * field, size_t size) {
+  uint64_t value = 0;
+  if (field[0] & 0x80) {
+    value = field[0] & 0x7f;
+    for (size_t i = 1; i < size; i++) {
+      value = value << 8 | field[i];
+    }
+    return value;
+  }
+  for (size_t i = 0; i < size; i++) {
+    if (field[i] >= '0' and field[i] <= '7') {
+      value = value * 8 + (field[i] - '0');
+    } else if (field[i] != ' ' or value > 0) {
+      break;
+    }
+  }
+  return value;
+}
+
+// The checksum is the sum of the header with its own field as spaces.
+// Some old archivers summed signed bytes so accept either.
+static bool tar_checksum(const uint8_t * header) {
+  uint64_t expected = tar_number(header + 148, 8);
+  int64_t unsigned_sum = 0;
+  int64_t signed_sum = 0;
+  for (size_t i = 0; i < TAR_BLOCK_SIZE; i++) {
+    uint8_t byte = (i >= 148 and i < 156) ? ' ' : header[i];
+    unsigned_sum += byte;
+    signed_sum += int8_t(byte);
+  }
+  return uint64_t(unsigned_sum) == expected or uint64_t(signed_sum) == expected;
+}
+
+// The member name, with the ustar prefix if there is one
+static std::string tar_name(const uint8_t * header) {
+  std::string name = tar_string(header, 100);
+  if (std::memcmp(header + 257, "ustar", 5) == 0) {
+    std::string prefix = tar_string(header + 345, 155);
+    if (!prefix.empty()) name = prefix + "/" + name;
+  }
+  return name;
+}
+
+// Find the path in a pax extended header, whose
+// records look like "<length> <key>=<value>\n"
+static std::string pax_path(const uint8_t * data, size_t size) {
+  const char * text = reinterpret_cast<const char *>(data);
+  size_t position = 0;
+  while (position < size) {
+    size_t length = 0;
+    size_t cursor = position;
+    while (cursor < size and std::isdigit(text[cursor])) {
+      length = length * 10 + (text[cursor++] - '0');
+    }
+    if (length == 0 or position + length > size) break;
+    std::string record(text + cursor + 1, text + position + length - 1);
+    if (record.compare(0, 5, "path=") == 0) {
+      return record.substr(5);
+    }
+    position += length;
+  }
+  return std::string();
+}
+
+ShardReader::ShardReader(const std::string & filename, const ShardOptions & options) :
+  filename_(filename),
+  options_(options),
+  offset_(0),
+  padding_(0) {
+  prefetcher_.reset(new ShardPrefetcher(
+        filename_,
+        std::max(options_.read_size, TAR_BLOCK_SIZE),
+        std::max(options_.read_ahead, 1)));
+}
+
+ShardReader::~ShardReader() {
+}
+
+bool ShardReader::next_chunk() {
+  offset_ = 0;
+  return prefetcher_ -> next(chunk_);
+}
+
+const uint8_t * ShardReader::take(size_t size) {
+  // Point straight into the block if it holds all of it
+  if (chunk_.size() - offset_ >= size) {
+    const uint8_t * data = chunk_.data() + offset_;
+    offset_ += size;
+    return data;
+  }
+
+  // Otherwise gather it from as many blocks as it takes
+  scratch_.resize(size);
+  size_t gathered = 0;
+  while (gathered < size) {
+    if (offset_ == chunk_.size() and !next_chunk()) {
+      if (gathered == 0) return NULL;
+      throw std::runtime_error(
+          "Unexpected end of shard: " + filename_);
+    }
+    size_t count = std::min(size - gathered, chunk_.size() - offset_);
+    std::memcpy(scratch_.data() + gathered, chunk_.data() + offset_, count);
+    gathered += count;
+    offset_ += count;
+  }
+  return scratch_.data();
+}
+
+void ShardReader::skip(size_t size) {
+  while (size > 0) {
+    if (offset_ == chunk_.size() and !next_chunk()) {
+      throw std::runtime_error(
+          "Unexpected end of shard: " + filename_);
+    }
+    size_t count = std::min(size, chunk_.size() - offset_);
+    offset_ += count;
+    size -= count;
+  }
+}
+
+bool ShardReader::wanted(const std::string & name) const {
+  if (options_.extensions.empty()) return true;
+
+  size_t dot = name.rfind('.');
+  if (dot == std::string::npos) return false;
+  std::string extension = name.substr(dot + 1);
+  std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+  for (std::string wanted : options_.extensions) {
+    std::transform(wanted.begin(), wanted.end(), wanted.begin(), ::tolower);
+    if (!wanted.empty() and wanted[0] == '.') wanted.erase(0, 1);
+    if (wanted == extension) return true;
+  }
+  return false;
+}
+
+template <typename T>
+bool ShardReader::next(ReadResult<T> & result) {
+  // Set by GNU long name and pax headers for the member that follows
+  std::string long_name;
+
+  while (true) {
+    skip(padding_);
+    padding_ = 0;
+
+    const uint8_t * header = take(TAR_BLOCK_SIZE);
+    if (!header) return false;
+
+    // Zero blocks end an archive, but another may be concatenated after it
+    if (std::all_of(header, header + TAR_BLOCK_SIZE, [](uint8_t byte) { return byte == 0; })) {
+      continue;
+    }
+    if (!tar_checksum(header)) {
+      throw std::runtime_error(
+          "Invalid tar header in shard: " + filename_);
+    }
+
+    // Read everything from the header before it can be overwritten
+    size_t size = tar_number(header + 124, 12);
+    char type = header[156];
+    std::string name = long_name.empty() ? tar_name(header) : long_name;
+    padding_ = (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+
+    if (type == 'L' or type == 'x') {
+      const uint8_t * data = take(size);
+      if (size > 0 and !data) {
+        throw std::runtime_error(
+            "Unexpected end of shard: " + filename_);
+      }
+      long_name = (type == 'L') ? tar_string(data, size) : pax_path(data, size);
+      continue;
+    }
+    long_name.clear();
+
+    // Skip directories, links and anything else we weren't asked for
+    bool file = (type == '0' or type == '\0' or type == '7');
+    if (not file or size == 0 or not wanted(name)) {
+      skip(size);
+      continue;
+    }
+
+    const uint8_t * data = take(size);
+    if (!data) {
+      throw std::runtime_error(
+          "Unexpected end of shard: " + filename_);
+    }
+
+    // Decode the member where it is
+    result = ReadResult<T>();
+    result.filename = name;
+    try {
+      result.audio = read<T>(data, size, result.sample_rate, 0, -1, options_.read);
+    } catch (...) {
+      result.error = std::current_exception();
+    }
+    return true;
+  }
+}
+
+template bool ShardReader::next<int16_t>(ReadResult<int16_t> &);
+template bool ShardReader::next<int32_t>(ReadResult<int32_t> &);
+template bool ShardReader::next<float>(ReadResult<float> &);
+template bool ShardReader::next<double>(ReadResult<double> &);
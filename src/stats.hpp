@@ -0,0 +1,45 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+
+namespace audiorw {
+namespace internal {
+
+// Instrumentation is only compiled in with AUDIORW_STATS,
+// otherwise these do nothing and are optimized away
+
+// Adds the time until it goes out of scope to a counter in nanoseconds
+class StageTimer {
+  public:
+#ifdef AUDIORW_STATS
+    explicit StageTimer(int64_t & counter) :
+      counter_(counter),
+      start_(std::chrono::steady_clock::now()) {
+    }
+
+    ~StageTimer() {
+      counter_ += std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now() - start_).count();
+    }
+
+  private:
+    int64_t & counter_;
+    std::chrono::steady_clock::time_point start_;
+#else
+    explicit StageTimer(int64_t &) {
+    }
+#endif
+};
+
+inline void tally(int64_t & counter, int64_t amount=1) {
+#ifdef AUDIORW_STATS
+  counter += amount;
+#else
+  (void) counter;
+  (void) amount;
+#endif
+}
+
+}
+}
@@ -0,0 +1,766 @@
+#include <vector>
+#include <string>
+#include <stdexcept>
+#include <ciso646>
+#include <algorithm>
+#include <map>
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libswresample/swresample.h>
+};
+
+#include "audiorw.hpp"
+#include "internal.hpp"
+#include "pcm.hpp"
+#include "io.hpp"
+#include "cache.hpp"
+#include "frames.hpp"
+#include "kernels.hpp"
+
+using namespace audiorw;
+using namespace audiorw::internal;
+
+// What an encoder is cached by
+static EncoderKey encoder_key(
+    AVCodecID codec_id,
+    AVSampleFormat sample_format,
+    int sample_rate,
+    int channels,
+    int flags,
+    const WriteOptions & options) {
+  EncoderKey key = {
+    codec_id,
+    sample_format,
+    sample_rate,
+    channels,
+    uint64_t(av_get_default_channel_layout(channels)),
+    options.bit_rate,
+    flags & AV_CODEC_FLAG_GLOBAL_HEADER,
+    options.quality,
+    options.compression_level,
+    options.bits_per_sample,
+    options.frame_size,
+    options.threads,
+    options.thread_type,
+    options.codec_options
+  };
+  return key;
+}
+
+// The bits per stored sample and whether they are floating
+// point for the requested sample format of uncompressed files
+static void pcm_sample_size(
+    const WriteOptions & options,
+    const std::string & filename,
+    int & bits,
+    bool & floating_point) {
+  floating_point = false;
+  switch (av_get_packed_sample_fmt(options.sample_format)) {
+    case AV_SAMPLE_FMT_NONE:
+      bits = options.bits_per_sample > 0 ? options.bits_per_sample : 16;
+      break;
+    case AV_SAMPLE_FMT_S16:
+      bits = 16;
+      break;
+    case AV_SAMPLE_FMT_S32:
+      bits = options.bits_per_sample > 0 ? options.bits_per_sample : 32;
+      break;
+    case AV_SAMPLE_FMT_FLT:
+      bits = 32;
+      floating_point = true;
+      break;
+    case AV_SAMPLE_FMT_DBL:
+      bits = 64;
+      floating_point = true;
+      break;
+    default:
+      bits = 0;
+  }
+
+  bool valid = floating_point or bits == 16 or bits == 24 or bits == 32;
+  if (not valid or (options.bits_per_sample > 0 and options.bits_per_sample != bits)) {
+    throw std::invalid_argument(
+        "Can not store " + std::to_string(options.bits_per_sample) + " bit samples of format " +
+        std::to_string(options.sample_format) + " in file: " + filename);
+  }
+}
+
+// Uncompressed containers default to 16 bit samples,
+// switch to the PCM codec for the requested format
+static AVCodecID pcm_codec_id(
+    AVCodecID codec_id,
+    const WriteOptions & options,
+    const std::string & filename) {
+  bool big_endian;
+  if (codec_id == AV_CODEC_ID_PCM_S16LE) {
+    big_endian = false;
+  } else if (codec_id == AV_CODEC_ID_PCM_S16BE) {
+    big_endian = true;
+  } else {
+    return codec_id;
+  }
+
+  int bits;
+  bool floating_point;
+  pcm_sample_size(options, filename, bits, floating_point);
+  if (floating_point) {
+    if (bits == 32) return big_endian ? AV_CODEC_ID_PCM_F32BE : AV_CODEC_ID_PCM_F32LE;
+    return big_endian ? AV_CODEC_ID_PCM_F64BE : AV_CODEC_ID_PCM_F64LE;
+  } else if (bits == 24) {
+    return big_endian ? AV_CODEC_ID_PCM_S24BE : AV_CODEC_ID_PCM_S24LE;
+  } else if (bits == 32) {
+    return big_endian ? AV_CODEC_ID_PCM_S32BE : AV_CODEC_ID_PCM_S32LE;
+  }
+  return codec_id;
+}
+
+// The requested sample format, or its planar or packed twin, if
+// the encoder supports it. Otherwise the encoder's preferred format.
+static AVSampleFormat encoder_format(
+    const AVCodec * codec,
+    const WriteOptions & options,
+    const std::string & filename) {
+  AVSampleFormat requested = options.sample_format;
+  if (requested == AV_SAMPLE_FMT_NONE) {
+    // Deeper integer samples need a deeper format
+    if (options.bits_per_sample <= 16) return codec -> sample_fmts[0];
+    requested = AV_SAMPLE_FMT_S32;
+  }
+
+  for (const AVSampleFormat * format = codec -> sample_fmts; *format != AV_SAMPLE_FMT_NONE; format++) {
+    if (*format == requested) return *format;
+  }
+  for (const AVSampleFormat * format = codec -> sample_fmts; *format != AV_SAMPLE_FMT_NONE; format++) {
+    if (av_get_packed_sample_fmt(*format) == av_get_packed_sample_fmt(requested)) return *format;
+  }
+  throw std::invalid_argument(
+      "The " + std::string(codec -> name) + " encoder does not support sample format " +
+      std::to_string(requested) + " for file: " + filename);
+}
+
+// Options for FFMPEG, which takes ownership of the dictionary
+static AVDictionary * dictionary(const std::map<std::string, std::string> & options) {
+  AVDictionary * dictionary = NULL;
+  for (const auto & option : options) {
+    av_dict_set(&dictionary, option.first.c_str(), option.second.c_str(), 0);
+  }
+  return dictionary;
+}
+
+// Free what FFMPEG left of a dictionary and return the first
+// option it didn't recognize, or an empty string
+static std::string unused_option(AVDictionary *& dictionary) {
+  AVDictionaryEntry * entry = av_dict_get(dictionary, "", NULL, AV_DICT_IGNORE_SUFFIX);
+  std::string name = entry ? entry -> key : "";
+  av_dict_free(&dictionary);
+  return name;
+}
+
+// What a resampler from the input to the encoder is cached by
+static ResamplerKey resampler_key(
+    const AVCodecContext * codec_context,
+    AVSampleFormat format) {
+  ResamplerKey key = {
+    codec_context -> channel_layout,
+    format,
+    codec_context -> sample_rate,
+    codec_context -> channel_layout,
+    codec_context -> sample_fmt,
+    codec_context -> sample_rate,
+    ResampleQuality::Default
+  };
+  return key;
+}
+
+Writer::Writer(int channels, const WriteOptions & options) :
+  channels_(channels),
+  options_(options),
+  open_(false),
+  format_context_(NULL),
+  codec_context_(NULL),
+  resample_context_(NULL),
+  frame_(NULL),
+  packet_(NULL),
+  input_format_(AV_SAMPLE_FMT_NONE),
+  pts_(0) {
+}
+
+// Once the delegated constructor has finished the
+// destructor releases everything if opening fails
+
+Writer::Writer(
+    const std::string & filename,
+    double sample_rate,
+    int channels,
+    const WriteOptions & options) :
+  Writer(channels, options) {
+  filename_ = filename;
+  open(sample_rate);
+}
+
+Writer::Writer(
+    std::vector<uint8_t> & output,
+    const std::string & format,
+    double sample_rate,
+    int channels,
+    const WriteOptions & options) :
+  Writer(vector_callbacks(output), format, sample_rate, channels, options) {
+}
+
+Writer::Writer(
+    const WriteCallbacks & callbacks,
+    const std::string & format,
+    double sample_rate,
+    int channels,
+    const WriteOptions & options) :
+  Writer(channels, options) {
+  filename_ = "callbacks";
+  format_ = format;
+  io_.reset(new CallbackIO(callbacks, options_.io_buffer_size));
+  open(sample_rate);
+}
+
+Writer::~Writer() {
+  // Finish the file if the writer was never closed
+  if (open_) {
+    try {
+      close();
+    } catch (...) {
+    }
+  }
+  release();
+}
+
+void Writer::open(double sample_rate) {
+  int channels = channels_;
+  if (channels <= 0) {
+    throw std::invalid_argument(
+        "Can not write audio with " + std::to_string(channels) +
+        " channels to file: " + filename_);
+  }
+
+  // Uncompressed files are written directly, unless the
+  // encoder or muxer was given options only FFMPEG understands
+  PcmFormat::Container container;
+  if (!io_ and options_.codec.empty() and options_.codec_options.empty() and
+      options_.format_options.empty() and pcm_container(filename_, container)) {
+    int bits;
+    bool floating_point;
+    pcm_sample_size(options_, filename_, bits, floating_point);
+    pcm_.reset(new PcmWriter());
+    pcm_ -> open(filename_, pcm_format(container, sample_rate, channels, bits, floating_point),
+        options_.dither);
+    open_ = true;
+    return;
+  }
+
+  // Create a format context for the output container format
+  if (!(format_context_ = avformat_alloc_context())) {
+    throw std::runtime_error(
+        "Could not allocate output format context for file:" + filename_);
+  }
+
+  // Open the output file to write to it, or write through callbacks
+  int error;
+  if (io_) {
+    format_context_ -> pb = io_ -> context();
+    format_context_ -> flags |= AVFMT_FLAG_CUSTOM_IO;
+  } else if ((error = avio_open(&format_context_ -> pb, filename_.c_str(), AVIO_FLAG_WRITE)) < 0) {
+    throw std::invalid_argument(
+        "Could not open file:" + filename_ + "\n" +
+        error_string(error));
+  }
+
+  // Use the named format or guess it from the file name
+  const char * format_name = format_.empty() ? NULL : format_.c_str();
+  const char * filename = io_ ? NULL : filename_.c_str();
+  if (!(format_context_ -> oformat = av_guess_format(format_name, filename, NULL))) {
+    throw std::runtime_error(
+        "Could not find output file format for file: " + filename_);
+  }
+
+  // Add the file pathname to the output context
+  if (!(format_context_ -> url = av_strdup(filename_.c_str()))) {
+    throw std::runtime_error(
+        "Could not process file path name for file: " + filename_);
+  }
+
+  // Use the named encoder or guess one for the file
+  AVCodec * output_codec;
+  if (!options_.codec.empty()) {
+    if (!(output_codec = avcodec_find_encoder_by_name(options_.codec.c_str()))) {
+      throw std::invalid_argument(
+          "Could not find encoder " + options_.codec + " for file: " + filename_);
+    }
+  } else {
+    AVCodecID codec_id = av_guess_codec(
+        format_context_ -> oformat,
+        NULL,
+        filename,
+        NULL,
+        AVMEDIA_TYPE_AUDIO);
+    codec_id = pcm_codec_id(codec_id, options_, filename_);
+
+    // Find an encoder based on the codec
+    if (!(output_codec = avcodec_find_encoder(codec_id))) {
+      throw std::runtime_error(
+          "Could not open codec with ID, " + std::to_string(codec_id) + ", for file: " + filename_);
+    }
+  }
+  AVSampleFormat sample_format = encoder_format(output_codec, options_, filename_);
+
+  // Create a new audio stream in the output file container
+  AVStream * stream;
+  if (!(stream = avformat_new_stream(format_context_, NULL))) {
+    throw std::runtime_error(
+        "Could not create new stream for output file: " + filename_);
+  }
+
+  // Set the sample rate of the container
+  stream -> time_base.den = sample_rate;
+  stream -> time_base.num = 1;
+
+  // Add a global header if necessary
+  int flags = 0;
+  if (format_context_ -> oformat -> flags & AVFMT_GLOBALHEADER)
+    flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+  // Reuse an encoder opened with the same parameters
+  if (options_.cache) {
+    codec_context_ = options_.cache -> pool_ -> take_encoder(encoder_key(
+          output_codec -> id, sample_format, sample_rate, channels, flags, options_));
+  }
+
+  if (!codec_context_) {
+    // Allocate an encoding context
+    if (!(codec_context_ = avcodec_alloc_context3(output_codec))) {
+      throw std::runtime_error(
+          "Could not allocate an encoding context for output file: " + filename_);
+    }
+
+    // Set the parameters of the stream
+    codec_context_ -> channels = channels;
+    codec_context_ -> channel_layout = av_get_default_channel_layout(channels);
+    codec_context_ -> sample_rate = sample_rate;
+    codec_context_ -> sample_fmt = sample_format;
+    codec_context_ -> bit_rate = options_.bit_rate;
+    codec_context_ -> flags |= flags;
+    codec_context_ -> thread_count = options_.threads;
+    codec_context_ -> thread_type = options_.thread_type;
+
+    // Set how the encoder trades size, quality and speed
+    if (options_.quality >= 0) {
+      codec_context_ -> flags |= AV_CODEC_FLAG_QSCALE;
+      codec_context_ -> global_quality = options_.quality * FF_QP2LAMBDA;
+    }
+    if (options_.compression_level >= 0) {
+      codec_context_ -> compression_level = options_.compression_level;
+    }
+    if (options_.bits_per_sample > 0) {
+      codec_context_ -> bits_per_raw_sample = options_.bits_per_sample;
+    }
+    if (options_.frame_size > 0) {
+      codec_context_ -> frame_size = options_.frame_size;
+    }
+
+    // Open the encoder for the audio stream to use
+    AVDictionary * codec_options = dictionary(options_.codec_options);
+    error = avcodec_open2(codec_context_, output_codec, &codec_options);
+    std::string unused = unused_option(codec_options);
+    if (error < 0) {
+      throw std::runtime_error(
+          "Could not open output codec for file: " + filename_ + "\n" +
+          error_string(error));
+    }
+    if (!unused.empty()) {
+      throw std::invalid_argument(
+          "Unknown encoder option " + unused + " for file: " + filename_);
+    }
+  }
+
+  // Make sure everything has been initialized correctly
+  error = avcodec_parameters_from_context(stream -> codecpar, codec_context_);
+  if (error < 0) {
+    throw std::runtime_error(
+        "Could not initialize stream parameters for file: " + filename_);
+  }
+
+  // Write the header to the output file
+  AVDictionary * format_options = dictionary(options_.format_options);
+  error = avformat_write_header(format_context_, &format_options);
+  std::string unused = unused_option(format_options);
+  if (error < 0) {
+    if (io_) io_ -> rethrow();
+    throw std::runtime_error(
+        "Could not write output file header for file: " + filename_ + "\n" +
+        error_string(error));
+  }
+  if (!unused.empty()) {
+    throw std::invalid_argument(
+        "Unknown format option " + unused + " for file: " + filename_);
+  }
+
+  // Dither float samples at the depth the encoder keeps, e.g.
+  // 24 bits of the 32 bit samples it takes. Floating point
+  // encoders take the samples as they are.
+  if (options_.dither) {
+    AVSampleFormat encoded_format = av_get_packed_sample_fmt(codec_context_ -> sample_fmt);
+    if (encoded_format == AV_SAMPLE_FMT_S16 or encoded_format == AV_SAMPLE_FMT_S32) {
+      int bits = av_get_bytes_per_sample(encoded_format) * 8;
+      int stored_bits = codec_context_ -> bits_per_raw_sample > 0 ?
+        codec_context_ -> bits_per_raw_sample :
+        av_get_bits_per_sample(codec_context_ -> codec_id);
+      if (stored_bits > 0 and stored_bits < bits) bits = stored_bits;
+      dither_.reset(new Dither(bits));
+    } else if (encoded_format != AV_SAMPLE_FMT_FLT and encoded_format != AV_SAMPLE_FMT_DBL) {
+      throw std::invalid_argument(
+          "Can not dither samples of format " +
+          std::string(av_get_sample_fmt_name(codec_context_ -> sample_fmt)) +
+          " for file: " + filename_);
+    }
+  }
+
+  // Construct a packet for the encoded frames
+  if (!(packet_ = av_packet_alloc())) {
+    throw std::runtime_error(
+        "Could not allocate packet for file: " + filename_);
+  }
+
+  // Initialize the output frame
+  if (!(frame_ = av_frame_alloc())) {
+    throw std::runtime_error(
+        "Could not allocate output frame for file: " + filename_);
+  }
+  if (codec_context_ -> frame_size <= 0) {
+    codec_context_ -> frame_size = options_.frame_size > 0 ? options_.frame_size : DEFAULT_FRAME_SIZE;
+  }
+  // Its samples are pooled, and shared between files through the cache
+  frame_pool_ = options_.cache ?
+    options_.cache -> pool_ -> frames() :
+    std::make_shared<FramePool>();
+  allocate_frame();
+  open_ = true;
+}
+
+void Writer::release() {
+  // Hand the resampler back to the cache rather than freeing it
+  if (options_.cache and codec_context_ and resample_context_ and input_format_ != AV_SAMPLE_FMT_NONE) {
+    options_.cache -> pool_ -> give_resampler(
+        resampler_key(codec_context_, input_format_), resample_context_);
+    resample_context_ = NULL;
+  }
+
+  // Properly free any allocated space
+  pcm_.reset();
+  avcodec_free_context(&codec_context_);
+  if (format_context_) {
+    // Callback IO is freed along with the writer
+    if (!io_) avio_closep(&format_context_ -> pb);
+    avformat_free_context(format_context_);
+    format_context_ = NULL;
+  }
+  swr_free(&resample_context_);
+  av_frame_free(&frame_);
+  av_packet_free(&packet_);
+}
+
+void Writer::write_block(const int16_t * audio, size_t frames) {
+  const uint8_t * data = reinterpret_cast<const uint8_t *>(audio);
+  write_samples(&data, frames, SampleFormat<int16_t>::packed);
+}
+
+void Writer::write_block(const int32_t * audio, size_t frames) {
+  const uint8_t * data = reinterpret_cast<const uint8_t *>(audio);
+  write_samples(&data, frames, SampleFormat<int32_t>::packed);
+}
+
+void Writer::write_block(const float * audio, size_t frames) {
+  const uint8_t * data = reinterpret_cast<const uint8_t *>(audio);
+  write_samples(&data, frames, SampleFormat<float>::packed);
+}
+
+void Writer::write_block(const double * audio, size_t frames) {
+  const uint8_t * data = reinterpret_cast<const uint8_t *>(audio);
+  write_samples(&data, frames, SampleFormat<double>::packed);
+}
+
+void Writer::write_block(const int16_t * const * audio, size_t frames) {
+  const uint8_t * const * data = reinterpret_cast<const uint8_t * const *>(audio);
+  write_samples(data, frames, SampleFormat<int16_t>::planar);
+}
+
+void Writer::write_block(const int32_t * const * audio, size_t frames) {
+  const uint8_t * const * data = reinterpret_cast<const uint8_t * const *>(audio);
+  write_samples(data, frames, SampleFormat<int32_t>::planar);
+}
+
+void Writer::write_block(const float * const * audio, size_t frames) {
+  const uint8_t * const * data = reinterpret_cast<const uint8_t * const *>(audio);
+  write_samples(data, frames, SampleFormat<float>::planar);
+}
+
+void Writer::write_block(const double * const * audio, size_t frames) {
+  const uint8_t * const * data = reinterpret_cast<const uint8_t * const *>(audio);
+  write_samples(data, frames, SampleFormat<double>::planar);
+}
+
+template <typename T>
+void Writer::write_block(const AudioBuffer<T> & audio) {
+  if (audio.channels() != channels_) {
+    throw std::invalid_argument(
+        "Can not write a buffer with " + std::to_string(audio.channels()) +
+        " channels to " + std::to_string(channels_) +
+        " channels for file: " + filename_);
+  }
+
+  if (audio.interleaved()) {
+    const uint8_t * data = reinterpret_cast<const uint8_t *>(audio.data());
+    write_samples(&data, audio.frames(), SampleFormat<T>::packed);
+  } else if (audio.planar()) {
+    buffer_planes_.resize(audio.channels());
+    for (int channel = 0; channel < audio.channels(); channel++) {
+      buffer_planes_[channel] = reinterpret_cast<const uint8_t *>(audio.channel(channel));
+    }
+    write_samples(buffer_planes_.data(), audio.frames(), SampleFormat<T>::planar);
+  } else {
+    throw std::invalid_argument(
+        "Can only write planar or interleaved buffers to file: " + filename_);
+  }
+}
+
+template void Writer::write_block<int16_t>(const AudioBuffer<int16_t> &);
+template void Writer::write_block<int32_t>(const AudioBuffer<int32_t> &);
+template void Writer::write_block<float>(const AudioBuffer<float> &);
+template void Writer::write_block<double>(const AudioBuffer<double> &);
+
+void Writer::close() {
+  if (!open_) {
+    throw std::logic_error(
+        "Writer is already closed for file: " + filename_);
+  }
+  open_ = false;
+
+  // Fill in the sizes of natively written files
+  if (pcm_) {
+    pcm_ -> close();
+    return;
+  }
+
+  // Encode whatever is left over as a short last frame
+  if (frame_ -> nb_samples > 0) {
+    encode_frame(frame_);
+  }
+
+  // Drain the encoder
+  av_frame_free(&frame_);
+  encode_frame(NULL);
+
+  // Write the trailer to the output file
+  int error;
+  if ((error = av_write_trailer(format_context_)) < 0) {
+    if (io_) io_ -> rethrow();
+    throw std::runtime_error(
+        "Could not write output file trailer for file: " + filename_ + "\n" +
+        error_string(error));
+  }
+
+  // The drained encoder and its resampler can be used again for another file
+  if (options_.cache) {
+    ContextPool & pool = *options_.cache -> pool_;
+    if (resample_context_ and input_format_ != AV_SAMPLE_FMT_NONE) {
+      pool.give_resampler(resampler_key(codec_context_, input_format_), resample_context_);
+      resample_context_ = NULL;
+    }
+    pool.give_encoder(
+        encoder_key(
+          codec_context_ -> codec_id,
+          codec_context_ -> sample_fmt,
+          codec_context_ -> sample_rate,
+          codec_context_ -> channels,
+          codec_context_ -> flags,
+          options_),
+        codec_context_);
+    codec_context_ = NULL;
+  }
+
+  // Flush callback IO, which is freed along with the writer
+  if (io_) {
+    avio_flush(format_context_ -> pb);
+    io_ -> rethrow();
+    if ((error = format_context_ -> pb -> error) < 0) {
+      throw std::runtime_error(
+          "Could not write to: " + filename_ + "\n" +
+          error_string(error));
+    }
+    return;
+  }
+
+  // Close the file
+  if ((error = avio_closep(&format_context_ -> pb)) < 0) {
+    throw std::runtime_error(
+        "Could not close file: " + filename_ + "\n" +
+        error_string(error));
+  }
+}
+
+void Writer::write_samples(const uint8_t * const * audio, size_t frames, AVSampleFormat format) {
+  if (!open_) {
+    throw std::logic_error(
+        "Can not write to closed writer for file: " + filename_);
+  }
+  if (pcm_) {
+    pcm_ -> write(audio, format, frames);
+    return;
+  }
+
+  // Samples already in the encoder's format are copied as is, and
+  // floats going to integers are converted without the resampler
+  AVSampleFormat sample_format = codec_context_ -> sample_fmt;
+  bool quantize_input = quantizable(format, sample_format);
+  bool convert = (format != sample_format) and not quantize_input;
+  if (convert) {
+    configure_input(format);
+  }
+
+  size_t written = 0;
+  while (written < frames) {
+    // Fill the frame up to the encoder's frame size
+    int count = std::min(
+        size_t(codec_context_ -> frame_size - frame_ -> nb_samples),
+        frames - written);
+    offset_planes(const_cast<uint8_t * const *>(audio), format,
+        codec_context_ -> channels, written, input_planes_);
+    offset_planes(frame_ -> extended_data, codec_context_ -> sample_fmt,
+        codec_context_ -> channels, frame_ -> nb_samples, output_planes_);
+    if (quantize_input) {
+      quantize(audio, format, written, frame_ -> extended_data, sample_format,
+          frame_ -> nb_samples, codec_context_ -> channels, count, dither_.get());
+    } else if (convert) {
+      int error = swr_convert(resample_context_,
+          output_planes_.data(), count,
+          const_cast<const uint8_t **>(input_planes_.data()), count);
+      if (error < 0) {
+        throw std::runtime_error(
+            "Could not resample frame for file: " + filename_ + "\n" +
+            error_string(error));
+      }
+    } else {
+      av_samples_copy(output_planes_.data(), input_planes_.data(),
+          0, 0, count, codec_context_ -> channels, format);
+    }
+    frame_ -> nb_samples += count;
+    written += count;
+
+    // Send full frames to the encoder
+    if (frame_ -> nb_samples == codec_context_ -> frame_size) {
+      encode_frame(frame_);
+    }
+  }
+}
+
+void Writer::encode_frame(AVFrame * frame) {
+  // Timestamp the frame
+  if (frame) {
+    frame -> pts = pts_;
+    pts_ += frame -> nb_samples;
+  }
+
+  // Send a frame to the encoder to encode
+  int error;
+  if ((error = avcodec_send_frame(codec_context_, frame)) < 0) {
+    throw std::runtime_error(
+        "Could not send packet for encoding for file: " + filename_ + "\n" +
+        error_string(error));
+  }
+
+  // Receive the encoded frame from the encoder
+  while ((error = avcodec_receive_packet(codec_context_, packet_)) == 0) {
+    // Write the encoded frame to the file
+    error = av_write_frame(format_context_, packet_);
+    av_packet_unref(packet_);
+    if (error < 0) {
+      if (io_) io_ -> rethrow();
+      throw std::runtime_error(
+          "Could not write frame for file: " + filename_ + "\n" +
+          error_string(error));
+    }
+  }
+
+  // If there was an error with the encoder
+  if (error != AVERROR(EAGAIN) and error != AVERROR_EOF) {
+    throw std::runtime_error(
+        "Could not encode frame for file: " + filename_ + "\n" +
+        error_string(error));
+  }
+
+  // The encoder may still hold a reference to the frame's
+  // samples, if so fill a fresh set from the pool
+  if (frame) {
+    frame -> nb_samples = 0;
+    if (!av_frame_is_writable(frame)) {
+      allocate_frame();
+    }
+  }
+}
+
+void Writer::allocate_frame() {
+  av_frame_unref(frame_);
+  frame_ -> nb_samples     = codec_context_ -> frame_size;
+  frame_ -> channel_layout = codec_context_ -> channel_layout;
+  frame_ -> channels       = codec_context_ -> channels;
+  frame_ -> format         = codec_context_ -> sample_fmt;
+  frame_ -> sample_rate    = codec_context_ -> sample_rate;
+  int error = frame_pool_ -> get_buffer(frame_);
+  if (error == AVERROR(ENOSYS)) {
+    // Too many channels for the pool
+    error = av_frame_get_buffer(frame_, 0);
+  }
+  if (error < 0) {
+    throw std::runtime_error(
+        "Could not allocate output frame samples for file: " + filename_ + "\n" +
+        error_string(error));
+  }
+  frame_ -> nb_samples = 0;
+}
+
+void Writer::configure_input(AVSampleFormat format) {
+  if (format == input_format_) return;
+
+  // Take a cached resampler already set up for this conversion
+  if (options_.cache and !resample_context_) {
+    resample_context_ = options_.cache -> pool_ -> take_resampler(
+        resampler_key(codec_context_, format));
+    if (resample_context_) {
+      input_format_ = format;
+      return;
+    }
+  }
+
+  // (Re)initialize the resampler for the new input format
+  resample_context_ = swr_alloc_set_opts(
+      resample_context_,
+      // Output
+      codec_context_ -> channel_layout,
+      codec_context_ -> sample_fmt,
+      codec_context_ -> sample_rate,
+      // Input
+      codec_context_ -> channel_layout,
+      format,
+      codec_context_ -> sample_rate,
+      0, NULL);
+  if (!resample_context_) {
+    throw std::runtime_error(
+        "Could not allocate resample context for file: " + filename_);
+  }
+
+  // Open the context with the specified parameters
+  int error;
+  if ((error = swr_init(resample_context_)) < 0) {
+    input_format_ = AV_SAMPLE_FMT_NONE;
+    throw std::runtime_error(
+        "Could not open resample context for file: " + filename_ + "\n" +
+        error_string(error));
+  }
+  input_format_ = format;
+}